@@ -0,0 +1,359 @@
+/*
+ * sara Window Manager
+ * ______________________________________________________________________________
+ *
+ * Please refer to the complete LICENSE file that should accompany this software.
+ * Please refer to the MIT license for details on usage: https://mit-license.org/
+ */
+
+/* make bench: times the client/monitor model and the layouts without an
+ * X server. sara.c is built in whole, and the X calls those paths make
+ * are stubbed out below, so what is left is sara's own bookkeeping.
+ * Every operation is followed by flushdirty, since that is where the
+ * work it puts off happens. Output is one line per measurement:
+ *
+ *	op	layout	clients	ns
+ *
+ * Before any of that, shuffle checks that the client list holds together
+ * through a long run of random moves, and fails the run if it doesn't.
+ */
+
+#define main saramain
+#include "sara.c"
+#undef main
+
+
+/* ---------------------------------------
+ * Typedefs
+ * ---------------------------------------
+ */
+
+typedef struct {
+	const char* name;
+	/* i counts up from 0, an even number of times */
+	void (*run)(int i);
+} benchop;
+
+
+/* ---------------------------------------
+ * Prototypes
+ * ---------------------------------------
+ */
+
+/* Checks */
+static void checklist(monitor* m, int n);
+static void shuffle(int n, int moves);
+/* Operations */
+static void bencharrange(int i);
+static void benchcurrent(int i);
+static void benchlayout(int i);
+static void benchmoveup(int i);
+static void benchtoggleview(int i);
+static void benchview(int i);
+static void benchwalk(int i);
+/* Setup */
+static void populate(int n);
+static void teardown();
+static long timeop(const benchop* op);
+
+
+/* ---------------------------------------
+ * Globals
+ * ---------------------------------------
+ */
+
+/* each measurement runs for at least this long */
+static const long benchus = 20000;
+static const int nclients[] = { 1, 10, 100, 1000, 10000 };
+static const benchop benchops[] = {
+	{ "layout",		benchlayout },
+	{ "arrange",		bencharrange },
+	{ "changecurrent",	benchcurrent },
+	{ "moveclientup",	benchmoveup },
+	{ "view",		benchview },
+	{ "toggleview",		benchtoggleview },
+	{ "walk",		benchwalk },
+};
+static float msize0;
+
+
+/* ---------------------------------------
+ * X Stubs
+ * ---------------------------------------
+ */
+
+int XChangeProperty(Display* d, Window w, Atom p, Atom t, int f, int m, const unsigned char* s, int n){ return 1; }
+int XConfigureWindow(Display* d, Window w, unsigned int m, XWindowChanges* wc){ return 1; }
+int XFlush(Display* d){ return 1; }
+int XGrabButton(Display* d, unsigned int b, unsigned int m, Window w, Bool o, unsigned int e,
+		int pm, int km, Window c, Cursor cur){ return 1; }
+int XMapWindow(Display* d, Window w){ return 1; }
+int XNoOp(Display* d){ return 1; }
+int XRaiseWindow(Display* d, Window w){ return 1; }
+int XSelectInput(Display* d, Window w, long m){ return 1; }
+Status XSendEvent(Display* d, Window w, Bool p, long m, XEvent* e){ return 1; }
+int XSetInputFocus(Display* d, Window w, int r, Time t){ return 1; }
+#ifdef _SHAPE_H_
+void XShapeCombineRectangles(Display* d, Window w, int k, int x, int y, XRectangle* r, int n, int o, int b){}
+#endif
+int XSync(Display* d, Bool b){ return 1; }
+int XUngrabButton(Display* d, unsigned int b, unsigned int m, Window w){ return 1; }
+
+
+/* ---------------------------------------
+ * Checks
+ * ---------------------------------------
+ */
+
+/* n clients, linked the same both ways, each findable and seen once,
+ * and the visible ones in vis in the same order, unless it's being rebuilt
+ */
+void
+checklist(monitor* m, int n){
+	int i = 0, nvis = 0;
+	client* c, * p = NULL;
+
+	if (m->head && m->head->prev)
+		die("shuffle: head has a prev");
+
+	for (c=m->head;c;p=c, c=c->next, i++){
+		if (c->prev != p)
+			die("shuffle: prev doesn't match next");
+		if (findclient(c->win) != c)
+			die("shuffle: lost from the hash table");
+		if (i > n)
+			die("shuffle: list has a cycle");
+		if (!ISVISIBLE(c))
+			continue;
+		if (!m->visstale && (nvis >= m->nvis || m->vis[nvis] != c))
+			die("shuffle: visible cache is out of order");
+		nvis++;
+	}
+
+	if (m->tail != p)
+		die("shuffle: tail isn't the last client");
+	if (i != n)
+		die("shuffle: wrong number of clients");
+
+	for (c=m->tail, i=0;c;c=c->prev, i++);
+	if (i != n)
+		die("shuffle: walking back finds a different number of clients");
+
+	updatevis(m);
+	if (m->nvis != nvis)
+		die("shuffle: visible cache is out of date");
+}
+
+/* every way a client can move around the list, at random */
+void
+shuffle(int n, int moves){
+	int i;
+	client* c;
+	winprops p = {0};
+
+	srand(1);
+	populate(n);
+
+	for (i=0;i < moves;i++){
+		if ( !(c = findclient(1 + rand() % n)) )
+			die("shuffle: lost a client");
+		curmon->current = c;
+
+		switch (rand() % 8){
+		case 0:
+			zoom(dumbarg);
+			break;
+		case 1:
+			moveclientup(c);
+			break;
+		case 2:
+			/* next to someone else */
+			detach(c, 1);
+			curmon->current = findclient(1 + rand() % n);
+			if (!curmon->current || curmon->current == c)
+				curmon->current = curmon->head;
+			attach(c, 1);
+			break;
+		case 3:
+			detach(c, 1);
+			attach(c, 0);
+			break;
+		case 4:
+			/* out, and back in as someone new with the same window */
+			p.win = c->win;
+			p.w = c->w;
+			p.h = c->h;
+			unmanage(c, 1);
+			manage(&p, NoFocus);
+			break;
+		case 5:
+			view((Arg) {.s = (rand() & 1) ? "1" : "0"});
+			break;
+		case 6:
+			setdesks(c, 1 << rand() % 3);
+			break;
+		case 7:
+			if (ISVISIBLE(c))
+				movefocus((Arg) {.s = (rand() & 1) ? "1" : "-1"});
+			break;
+		}
+
+		if (i % n == 0)
+			flushdirty();
+		if (i % 1000 == 0)
+			checklist(curmon, n);
+	}
+
+	flushdirty();
+	checklist(curmon, n);
+	teardown();
+	fprintf(stderr, "shuffle: %d clients, %d moves, ok\n", n, moves);
+}
+
+
+/* ---------------------------------------
+ * Operations
+ * ---------------------------------------
+ */
+
+/* msize flips every time, so tile has every rect to push */
+void
+bencharrange(int i){
+	curmon->msize = (i & 1) ? msize0 : msize0 + gappx;
+	arrange(curmon);
+	flushdirty();
+}
+
+void
+benchcurrent(int i){
+	changecurrent(curmon->vis[i % curmon->nvis], curmon, curmon->curdesk, 0);
+	flushdirty();
+}
+
+/* just the pure part, nothing is applied */
+void
+benchlayout(int i){
+	curmon->curlayout->arrange(curmon, curmon->nvis, curmon->rects);
+}
+
+void
+benchmoveup(int i){
+	moveclientup(curmon->vis[i % curmon->nvis]);
+	arrange(curmon);
+	flushdirty();
+}
+
+/* half the clients are on desktop 1, see populate */
+void
+benchtoggleview(int i){
+	toggleview((Arg) {.s = "1"});
+	flushdirty();
+}
+
+void
+benchview(int i){
+	view((Arg) {.s = (i & 1) ? "0" : "1"});
+	flushdirty();
+}
+
+/* the passes that read every client: rebuilding vis from the list, then
+ * checking each rect against the client, with nothing left to push
+ */
+void
+benchwalk(int i){
+	curmon->visstale = 1;
+	applylayout(curmon);
+}
+
+
+/* ---------------------------------------
+ * Setup
+ * ---------------------------------------
+ */
+
+/* n clients on one monitor, every other one on desktop 1 */
+void
+populate(int n){
+	int i;
+	winprops p = {0};
+
+	mhead = curmon = createmon(0, 0, 0, sw, sh);
+	msize0 = curmon->msize;
+
+	p.trans = None;
+	p.w = sw / 4;
+	p.h = sh / 4;
+	for (i=0;i < n;i++){
+		p.win = 1 + i;
+		manage(&p, NoFocus);
+		if (i & 1)
+			setdesks(findclient(p.win), 1 << 1);
+	}
+
+	flushdirty();
+}
+
+void
+teardown(){
+	while (curmon->head)
+		unmanage(curmon->head, 1);
+
+	flushdirty();
+	cleanupmon(curmon);
+	mhead = curmon = NULL;
+	/* so the next run doesn't inherit this one's free list order */
+	poolfree(&clientpool);
+}
+
+/* ns per run, doubling the runs until it takes long enough to trust */
+long
+timeop(const benchop* op){
+	int i, reps;
+	long t;
+
+	for (reps=2;;reps *= 2){
+		t = usecs(CLOCK_MONOTONIC);
+		for (i=0;i < reps;i++)
+			op->run(i);
+		t = usecs(CLOCK_MONOTONIC) - t;
+
+		if (t >= benchus)
+			return t * 1000 / reps;
+	}
+}
+
+
+int
+main(){
+	int i, j, k;
+
+	/* zeroed, for the Xlib macros that read it directly, like NextRequest */
+	dis = ecalloc(1, sizeof(*(_XPrivDisplay) dis));
+	sw = 1920;
+	sh = 1080;
+	root = 1;
+#ifdef _SHAPE_H_
+	initcorners();
+#endif
+
+	shuffle(10000, 50000);
+
+	printf("op\tlayout\tclients\tns\n");
+	for (i=0;i < TABLENGTH(nclients);i++){
+		populate(nclients[i]);
+
+		for (j=0;j < TABLENGTH(layouts);j++){
+			curmon->curlayout = (layout*) &layouts[j];
+			arrange(curmon);
+			flushdirty();
+
+			for (k=0;k < TABLENGTH(benchops);k++)
+				printf("%s\t%s\t%d\t%ld\n", benchops[k].name, layouts[j].name,
+					nclients[i], timeop(&benchops[k]));
+		}
+
+		teardown();
+	}
+
+	return 0;
+}
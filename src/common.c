@@ -8,6 +8,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef SHMRING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
 
 void
 die(const char* e, ...){
@@ -23,3 +30,58 @@ slen(const char* str){
 
 	return i;
 }
+
+#ifdef SHMRING
+/* map the command ring, creating (and emptying) it if asked */
+ring*
+ringmap(int create){
+	int fd;
+	ring* r;
+
+	if ( (fd = shm_open(INPUTRING, O_RDWR | (create ? O_CREAT|O_TRUNC : 0), 0600)) < 0 )
+		return NULL;
+
+	if (create && ftruncate(fd, sizeof(ring)) < 0){
+		close(fd);
+		return NULL;
+	}
+
+	r = mmap(NULL, sizeof(ring), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return (r == MAP_FAILED) ? NULL : r;
+}
+
+/* Queue msg for sara without a single syscall, unless sara is asleep.
+ * wakefd is INPUTWAKE, opened O_WRONLY|O_NONBLOCK. That fails (ENXIO)
+ * when sara isn't there to read it, as when a crash left the ring behind.
+ * Returns -1 then, or if the ring is full, so the caller can fall back
+ * to the socket.
+ */
+int
+ringsend(ring* r, int wakefd, const char* msg){
+	unsigned int head, tail;
+	ringslot* s;
+
+	if (wakefd < 0)
+		return -1;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	do {
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - tail >= RINGSLOTS)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&r->head, &head, head + 1, 1,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	s = &r->slots[head & (RINGSLOTS - 1)];
+	snprintf(s->msg, MAXBUFF, "%s", msg);
+	__atomic_store_n(&s->ready, 1, __ATOMIC_SEQ_CST);
+
+	/* if the fifo is full, sara is already on its way */
+	if (__atomic_exchange_n(&r->asleep, 0, __ATOMIC_SEQ_CST))
+		write(wakefd, "", 1);
+
+	return 0;
+}
+#endif
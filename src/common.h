@@ -10,12 +10,42 @@
 #define COMMON_H
 
 #define INPUTSOCK			"/tmp/sara.sock"
-/* longest is "changemsize -0.05" at 17, +1 for '\0' */
-#define MAXBUFF				18
+/* longest single message, terminator included
+ * messages are ended by '\n' (or '\0', for older sarasocks)
+ * leaves room for a subscribe template with a few colours in it
+ */
+#define MAXBUFF				1024
 /* max length of a progs command */
 #define MAXLEN				256
 
+#ifdef SHMRING
+/* shared memory command ring, in /dev/shm, and the fifo that wakes sara */
+#define INPUTRING			"/sara.ring"
+#define INPUTWAKE			"/tmp/sara.wake"
+/* must be a power of 2 */
+#define RINGSLOTS			64
+
+typedef struct {
+	unsigned int ready;
+	char msg[MAXBUFF];
+} ringslot;
+
+typedef struct {
+	/* next slot to claim, bumped by writers */
+	unsigned int head;
+	/* next slot to run, bumped by sara */
+	unsigned int tail;
+	/* sara is about to sleep, so the next writer must poke INPUTWAKE */
+	unsigned int asleep;
+	ringslot slots[RINGSLOTS];
+} ring;
+#endif
+
 void die(const char* e, ...);
 int slen(const char* str);
+#ifdef SHMRING
+ring* ringmap(int create);
+int ringsend(ring* r, int wakefd, const char* msg);
+#endif
 
 #endif
@@ -16,6 +16,7 @@
 
 #define NUMTAGS		9
 #define MOUSEMOD	Mod4Mask
+#define KEYMOD		Mod4Mask
 #define MASTER_SIZE     0.55
 
 
@@ -26,6 +27,16 @@ static const int gappx			= 10;
 static const int corner_radius		= 10;
 /* once within snappx of a monitor edge, snap to the edge */
 static const unsigned int snappx	= 32;
+/* how often a mouse move/resize redraws, best set to your refresh rate */
+static const unsigned int dragfps	= 60;
+/* focus follows the mouse once it has rested on a window this long (ms),
+ * so sweeping across a stack doesn't focus everything on the way. 0 is instant
+ */
+static const unsigned int hoverms	= 30;
+/* a sarasock batch not committed within this long (ms) is committed for it */
+static const unsigned int batchms	= 500;
+/* also publish every monitor at once to SARA_STATE, behind a change serial */
+static const int allstate		= 1;
 
 
 /* commands to be executed at startup. will be run in-order with /bin/sh
@@ -56,10 +67,57 @@ static const layout layouts[] = {
 	{ 'F',		floaty,		"floaty"   },
 };
 
+#ifdef GRABKEYS
+/* Built with -DGRABKEYS, sara grabs these keys itself and calls the same
+ * functions as sarasock does, without a fork/exec or socket per press.
+ * Delete an entry to leave that key to sxhkd instead.
+ */
+#define TAGKEYS(KEY,TAG) \
+	{ KEYMOD,                       KEY,      view,           {.s = TAG} }, \
+	{ KEYMOD|ShiftMask,             KEY,      toggledesktop,  {.s = TAG} }, \
+	{ KEYMOD|ControlMask,           KEY,      toggleview,     {.s = TAG} }, \
+	{ KEYMOD|ControlMask|ShiftMask, KEY,      todesktop,      {.s = TAG} },
+
+static const key keys[] = {
+	/* modifier                     key            function        argument */
+	{ KEYMOD|ShiftMask,             XK_e,          quit,           {.s = "0"} },
+	{ KEYMOD|ShiftMask,             XK_r,          quit,           {.s = "1"} },
+	{ KEYMOD|ShiftMask,             XK_q,          killclient,     {.s = "0"} },
+	{ KEYMOD,                       XK_j,          movefocus,      {.s = "-1"} },
+	{ KEYMOD,                       XK_k,          movefocus,      {.s = "+1"} },
+	{ KEYMOD|ShiftMask,             XK_j,          moveclient,     {.s = "-1"} },
+	{ KEYMOD|ShiftMask,             XK_k,          moveclient,     {.s = "+1"} },
+	{ KEYMOD|ShiftMask,             XK_space,      togglefloat,    {.s = "0"} },
+	{ KEYMOD|ShiftMask,             XK_Return,     togglefs,       {.s = "0"} },
+	{ KEYMOD,                       XK_Return,     zoom,           {.s = "0"} },
+	{ KEYMOD,                       XK_0,          toggleview,     {.s = "-1"} },
+	{ KEYMOD,                       XK_h,          changemsize,    {.s = "-0.05"} },
+	{ KEYMOD,                       XK_l,          changemsize,    {.s = "+0.05"} },
+	{ KEYMOD|ControlMask,           XK_t,          setlayout,      {.s = "tile"} },
+	{ KEYMOD|ControlMask,           XK_m,          setlayout,      {.s = "monocle"} },
+	{ KEYMOD,                       XK_comma,      focusmon,       {.s = "-1"} },
+	{ KEYMOD,                       XK_period,     focusmon,       {.s = "+1"} },
+	{ KEYMOD|ShiftMask,             XK_comma,      tomon,          {.s = "-1"} },
+	{ KEYMOD|ShiftMask,             XK_period,     tomon,          {.s = "+1"} },
+	TAGKEYS(                        XK_1,                          "0")
+	TAGKEYS(                        XK_2,                          "1")
+	TAGKEYS(                        XK_3,                          "2")
+	TAGKEYS(                        XK_4,                          "3")
+	TAGKEYS(                        XK_5,                          "4")
+	TAGKEYS(                        XK_6,                          "5")
+	TAGKEYS(                        XK_7,                          "6")
+	TAGKEYS(                        XK_8,                          "7")
+	TAGKEYS(                        XK_9,                          "8")
+};
+#endif
+
 static button buttons[] = {
 	/* event mask     button          function        argument */
 	{ MOUSEMOD,       Button1,        manipulate,     {.i = WantMove} },
 	{ MOUSEMOD,       Button3,        manipulate,     {.i = WantResize} },
+	/* only draw an outline until release, kinder to heavy clients */
+	{ MOUSEMOD|ShiftMask, Button1,    manipulate,     {.i = WantMove|WantOutline} },
+	{ MOUSEMOD|ShiftMask, Button3,    manipulate,     {.i = WantResize|WantOutline} },
 };
 
 #endif
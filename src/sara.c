@@ -7,26 +7,41 @@
  */ 
 
 /* general */
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 /* sockets */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <unistd.h>
+#ifdef SHMRING
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 /* Xlib */
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
-#include <X11/Xft/Xft.h>
+#include <X11/Xproto.h>
+#include <X11/keysym.h>
 #include <X11/extensions/shape.h>
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
 
 #include "common.h"
 
 
 #define SAFEPARG(A,B)			((A <= parg.i && parg.i <= B))
 #define BUTTONMASK              	(ButtonPressMask|ButtonReleaseMask)
+#define CLEANMASK(M)			((M & ~LockMask))
 #define MOUSEMASK               	(BUTTONMASK|PointerMotionMask)
 #define EACHCLIENT(I)			(ic=I;ic;ic=ic->next) /* ic is a global */
 #define EACHMON(M)			(im=M;im;im=im->next) /* im is a global */
@@ -35,14 +50,31 @@
 #define MAX(A,B)               		((A) > (B) ? (A) : (B))
 #define STREQ(A,B)			((strcmp(A,B) == 0))
 #define TABLENGTH(X)    		(sizeof(X)/sizeof(*X))
+/* XIDs are a per-connection base in the high bits plus a counter */
+#define WINHASH(W,N)			((((W) ^ (W) >> 21) & ((N) - 1)))
+/* messages handled per connection per trip around the event loop */
+#define IPCBUDGET			32
+/* unsent output a connection may pile up before it is dropped */
+#define MAXOUTBUF			(4 << 20)
+#define MAXEVENTS			64
+#define CACHELINE			64
+/* sizeof(T), rounded up to whole cache lines */
+#define LINES(T)			((((sizeof(T) + CACHELINE - 1) / CACHELINE) * CACHELINE))
+/* C's other half, see struct pool */
+#define COLD(C)				((clientcold*) ((char*) (C) + clientpool.perslab * clientpool.size))
+/* M's bit in a conn's held, monitors past the 32nd can't be held back */
+#define MONBIT(M)			(((M)->num < 32 ? 1u << (M)->num : 0))
 
 
-enum { AnyVis,     	OnlyVis };
 enum { NoZoom,     	YesZoom };
 enum { NoFocus,    	YesFocus };
-enum { WantMove,   	WantResize };
+enum { WantMove,   	WantResize,	WantOutline = 1 << 1 };
 enum { WantFloating,  	WantTiled,	WantDummy};
 enum { WantInt,    	WantFloat,	NumTypes};
+enum { WMProtocols,	WMDelete,	WMState,	SaraState,	WMLast };
+enum { DirtyVis = 1 << 0,	DirtyLayout = 1 << 1,	DirtyStack = 1 << 2,	DirtyStatus = 1 << 3,
+	DirtyFocus = 1 << 4 };
+#define DIRTYALL			((DirtyVis|DirtyLayout|DirtyStack|DirtyStatus|DirtyFocus))
 
 
 /* ---------------------------------------
@@ -50,10 +82,15 @@ enum { WantInt,    	WantFloat,	NumTypes};
  * ---------------------------------------
  */
 
+typedef struct buffer buffer;
 typedef struct client client;
+typedef struct clientcold clientcold;
+typedef struct conn conn;
 typedef struct desktop desktop;
 typedef struct monitor monitor;
+typedef struct pool pool;
 typedef struct rule rule;
+typedef struct winprops winprops;
 
 typedef union {
 	int i;
@@ -69,30 +106,99 @@ typedef struct {
 	const Arg arg;
 } button;
 
+typedef struct {
+	unsigned int mod;
+	KeySym keysym;
+	void (*func)(const Arg arg);
+	const Arg arg;
+} key;
+
+typedef struct {
+	int x, y, w, h;
+} rect;
+
+/* arrange fills in a rect for each of the n tiled clients, in stack
+ * order, and returns how many it filled; whoever is left over keeps the
+ * geometry they have. It only reads m, see applylayout for the X side.
+ */
 typedef struct {
 	const char letter;
-	void (*arrange)(monitor*);
+	int (*arrange)(const monitor* m, int n, rect* r);
 	/* for external layout setting */
 	const char* name;
 } layout;
 
+/* growable string, for building socket replies */
+struct buffer {
+	char* s;
+	size_t len;
+	size_t size;
+};
+
+/* Everything the layout, visibility and stacking passes read, in one
+ * 64 byte cache line on LP64; the rest is in its clientcold, which
+ * those passes never bring into cache.
+ */
 struct client {
 	int x, y, w, h;
-	/* being in monocle is not considered floating */
-	int isfloat;
-	/* prior to togglefs */
-	int oldfloat;
-	int isfull;
 	unsigned int desks;
 	unsigned int iscur;
+	/* being in monocle is not considered floating */
+	char isfloat;
+	char isfull;
+	/* placed on screen by showhide, rather than parked off it */
+	char shown;
+	/* prior to togglefs */
+	char oldfloat;
 	client* next;
+	client* prev;
 	monitor* mon;
 	Window win;
-}; 
+};
+
+/* only matters once a request actually goes out, or a window is looked up */
+struct clientcold {
+	/* what the server last got from us: geometry, and the size
+	 * the corners were rounded for (0 if squared off)
+	 */
+	int cx, cy, cw, ch;
+	int shapew, shapeh;
+	/* next in findclient's bucket */
+	client* hnext;
+};
+
+/* a sarasock connection, which may carry many messages */
+struct conn {
+	int fd;
+	/* drop input until the next terminator, after an overlong message */
+	int skip;
+	/* peer is done sending, but may still be listening */
+	int rdclosed;
+	/* failed a write, close at the end of this loop */
+	int dead;
+	/* ran out of budget with whole messages still buffered */
+	int pending;
+	/* between "begin" and "commit", holding back these monitors, see MONBIT,
+	 * until the commit or batchdue (ms), whichever comes first
+	 */
+	int inbatch;
+	unsigned int held;
+	long batchdue;
+	/* subscribers: only this monitor (-1 is all), and an optional template */
+	int subscribed;
+	int submon;
+	char* subfmt;
+	size_t len;
+	char buf[MAXBUFF];
+	buffer out;
+	conn* next;
+};
 
 struct desktop {
 	float msize;
 	layout* curlayout;
+	/* clients tagged with this desktop, see countclient */
+	int nclients;
 };
 
 struct monitor {
@@ -100,15 +206,52 @@ struct monitor {
 	int curdesk;
 	int mx, my, mh, mw, wy, wh;
 	int num;
+	/* work put off until the end of this loop, see flushdirty */
+	int dirty;
 	unsigned int seldesks;
+	/* desktops with any clients */
+	unsigned int occ;
+	/* the visible clients in stack order, see updatevis */
+	int visstale;
+	int nvis, vissize;
+	client** vis;
+	/* vissize of them, for the layout to fill in */
+	rect* rects;
+	/* pushevent lines, held back with the monitor by an open batch */
+	buffer events;
+	/* last published by outputstats, to SARA_MONSTATE_<num> */
+	char* state;
+	Atom stateatom;
 	client* current;
 	//client* prev;
 	client* head;
+	client* tail;
 	desktop* desks;
 	layout* curlayout;
 	monitor* next;
 };
 
+/* fixed size objects, carved out of cache line aligned slabs that never
+ * move or shrink, so a pointer stays good for as long as its object is
+ * in use
+ */
+struct pool {
+	const char* name;
+	size_t size;
+	int perslab;
+	/* each object has a second half of the same size, perslab objects
+	 * further into the slab, so a pass over the first halves streams
+	 * through nothing else
+	 */
+	int split;
+	/* freed objects, linked through their first bytes */
+	void* free;
+	void** slabs;
+	int nslabs;
+	/* for the pools query */
+	unsigned long gets, puts;
+};
+
 struct rule {
 	char* class;
 	char* instance;
@@ -119,6 +262,20 @@ struct rule {
 	int monitor;
 };
 
+/* what manage needs to know about a window, see fetchprops */
+struct winprops {
+	Window win;
+	/* the window was still there to ask about */
+	int ok;
+	int override_redirect;
+	int viewable;
+	int x, y, w, h;
+	Window trans;
+	char name[256];
+	char class[256];
+	char instance[256];
+};
+
 
 /* ---------------------------------------
  * Util Functions
@@ -136,35 +293,93 @@ ecalloc(size_t nmemb, size_t size){
 }
 
 void
-estrtoi(const char* s, Arg* arg){
-	arg->i = (int) strtol(s, (char**) NULL, 10);
+bufprintf(buffer* b, const char* fmt, ...){
+	int n;
+	va_list ap;
+
+	for (;;){
+		va_start(ap, fmt);
+		n = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+
+		if (b->len + n < b->size){
+			b->len += n;
+			return;
+		}
+
+		b->size = MAX(2 * b->size, b->len + n + 1);
+		if ( !(b->s = realloc(b->s, b->size)) )
+			die("realloc failed");
+	}
 }
 
-void
-estrtof(const char* s, Arg* arg){
-	arg->f = (float) strtof(s, (char**) NULL);
+long
+usecs(clockid_t clock){
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* a zeroed object from p, like ecalloc(1, p->size) */
+void*
+poolget(pool* p){
+	int i;
+	char* slab;
+	void* o;
+
+	if (!p->free){
+		/* room, and alignment, for the free list link */
+		p->size = (p->size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+		if ( !(p->slabs = realloc(p->slabs, (p->nslabs + 1) * sizeof(void*))) )
+			die("realloc failed");
+		if (posix_memalign(&p->slabs[p->nslabs], CACHELINE, p->perslab * p->size * (1 + p->split)))
+			die("posix_memalign failed");
+		slab = p->slabs[p->nslabs++];
+
+		for (i=p->perslab - 1;i >= 0;i--){
+			*(void**) (slab + i * p->size) = p->free;
+			p->free = slab + i * p->size;
+		}
+	}
+
+	o = p->free;
+	p->free = *(void**) o;
+	memset(o, 0, p->size);
+	if (p->split)
+		memset((char*) o + p->perslab * p->size, 0, p->size);
+	p->gets++;
+
+	return o;
 }
 
-/* convert 11011110 to "01111011"
- * for this example, len = 8
- * dest must be a calloc'd char* that you free() afterwards
- */
 void
-uitos(unsigned int ui, int len, char* dest){
-	int i, j, res;
-	int bytearray[len];
-	char bytestr[len + 1];
+poolput(pool* p, void* o){
+	*(void**) o = p->free;
+	p->free = o;
+	p->puts++;
+}
 
-	/* reverse the array, as tags are printed left to right, not right to left */
-	for (i=0;i < len;i++)
-		bytearray[i] = ui >> i & 1;
+/* only once nothing from p is in use */
+void
+poolfree(pool* p){
+	while (p->nslabs)
+		free(p->slabs[--p->nslabs]);
+	free(p->slabs);
+	p->slabs = p->free = NULL;
+}
 
-	for (i=0, j=0;
-	(i < (len + 1)) && (res = snprintf(bytestr + j, (len + 1) - j, "%d", bytearray[i])) > 0;
-	i++)
-		j += res;
+void
+estrtoi(const char* s, Arg* arg){
+	arg->i = (int) strtol(s, (char**) NULL, 10);
+}
 
-	snprintf(dest, len + 1, "%s", bytestr);
+void
+estrtof(const char* s, Arg* arg){
+	arg->f = (float) strtof(s, (char**) NULL);
 }
 
 
@@ -175,17 +390,21 @@ uitos(unsigned int ui, int len, char* dest){
 
 /* Clients */
 static void adjustcoords(client* c);
-static void applyrules(client* c);
+static void applyfocus(monitor* m);
+static void applygeom(client* c, int x, int y, int w, int h);
+static void applyrules(client* c, winprops* p);
 static void attach(client* c, int aside);
 static void changecurrent(client* c, monitor* m, int desk, int refocused);
 static void configure(client* c);
+static void countclient(client* c, int n);
 static void detach(client* c, int refocus_override);
 static client* findclient(Window w);
 static client* findcurrent(monitor* m);
-static client* findprevclient(client* c, int onlyvis, int onlytiled);
-static client* findvisclient(client* c, int wantfloat);
+static client* findprevclient(monitor* m, int i, int onlytiled);
+static client* findvisclient(monitor* m, int i, int wantfloat);
+static void hashclient(client* c);
 static void killclient(const Arg arg);
-static void manage(Window parent, XWindowAttributes* wa);
+static void manage(winprops* p, int wantfocus);
 static void manipulate(const Arg arg);
 static void moveclient(const Arg arg);
 static void moveclientup(client* c);
@@ -193,25 +412,36 @@ static void movefocus(const Arg arg);
 static void resizeclient(client* c, int x, int y, int w, int h);
 static void restack(monitor* m);
 static void sendmon(client* c, monitor* m);
+static void setdesks(client* c, unsigned int desks);
 static void showhide(monitor* m);
+static void stackclients(monitor* m);
 static void todesktop(const Arg arg);
 static void toggledesktop(const Arg arg);
 static void togglefloat(const Arg arg);
 static void togglefs(const Arg arg);
 static void tomon(const Arg arg);
+static void unhashclient(client* c);
 static void unmanage(client* c, int destroyed);
 static void updatefocus(monitor* m);
 static void zoom(const Arg arg);
 /* Desktops */
+static void applylayout(monitor* m);
 static void arrange(monitor* m);
 static void changemsize(const Arg arg);
-static void floaty(monitor* m);
+static int floaty(const monitor* m, int n, rect* r);
+static void flushdirty();
+static int isheld(monitor* m);
 static void loaddesktop(int i);
-static void monocle(monitor* m);
+static void markdirty(monitor* m, int bits);
+static int monocle(const monitor* m, int n, rect* r);
 static void setlayout(const Arg arg);
-static void tile(monitor* m);
+static int tile(const monitor* m, int n, rect* r);
 static void toggleview(const Arg arg);
+static void updatevis(monitor* m);
 static void view(const Arg arg);
+static int visindex(client* c);
+static void visinsert(monitor* m, int i, client* c);
+static void visremove(monitor* m, int i);
 /* Monitor Manipulation */
 static void changemon(monitor* m, int wantfocus);
 static void cleanupmon(monitor* m);
@@ -223,23 +453,56 @@ static void focusmon(const Arg arg);
 static void updategeom();
 /* Backend */
 static void cleanup();
+static void fetchprops(winprops* p, int n);
 static int getptrcoords(int* x, int* y);
 static void grabbuttons(client* c, int focused);
+#ifdef GRABKEYS
+static void grabkeys();
+#endif
+static void internatoms();
 static void outputstats();
 static void runconfig();
-static void setrootstats();
+static void setallstats();
+static void setrootstats(monitor* m, char* monstate);
+static void settlehover();
 static void setup();
 static void start();
+static int updatestats(monitor* m);
 static int xerror(Display* dis, XErrorEvent* e);
 static int xsendkill(Window w);
 static void quit(const Arg arg);
 #ifdef _SHAPE_H_
+static void initcorners();
 static void roundcorners(client* c);
 static void unroundcorners(client* c);
 #endif
 /* sarasock interfacing */
-static void handlemsg(char* msg);
+static void acceptconn(int sfd);
+static void beginbatch(conn* c, char* arg);
+static void closeconn(conn* c);
+static void commitbatch(conn* c, char* arg);
+#ifdef SHMRING
+static void drainring();
+#endif
+static void dumpclients(buffer* b);
+static void dumpmonitors(buffer* b);
+static void dumppools(buffer* b);
+static void dumpstate(buffer* b);
+static void flushconn(conn* c);
+static void fmtstatus(buffer* b, const char* fmt, size_t len, monitor* m, int tag);
+static void handleconn(conn* c);
+static void handlemsg(conn* c, char* msg);
+static void pushevent(monitor* m, const char* fmt, ...);
+static void pushstatus(monitor* m);
+static void readconn(conn* c);
+static void sendconn(conn* c, const char* s, size_t len);
+static void sendevents(monitor* m);
+static void sendstatus(conn* c, monitor* m);
+static void subscribe(conn* c, char* arg);
+static void watchconn(conn* c, int op);
+static void (*str2connfunc(const char* str))(conn*, char*);
 static void (*str2func(const char* str))(Arg);
+static void (*str2query(const char* str))(buffer*);
 /* X */
 static void adopt();
 static void buttonpress(XEvent* e);
@@ -248,6 +511,10 @@ static void configurerequest(XEvent* e);
 static void destroynotify(XEvent* e);
 static void enternotify(XEvent* e);
 static void focusin(XEvent* e);
+#ifdef GRABKEYS
+static void keypress(XEvent* e);
+static void mappingnotify(XEvent* e);
+#endif
 static void maprequest(XEvent* e);
 static void motionnotify(XEvent* e);
 static void unmapnotify(XEvent* e);
@@ -259,6 +526,10 @@ void (*events[LASTEvent])(XEvent* e) = {
 	[DestroyNotify] = destroynotify,
 	[EnterNotify] = enternotify,
 	[FocusIn] = focusin,
+#ifdef GRABKEYS
+	[KeyPress] = keypress,
+	[MappingNotify] = mappingnotify,
+#endif
 	[MapRequest] = maprequest,
 	[MotionNotify] = motionnotify,
 	[UnmapNotify] = unmapnotify
@@ -295,6 +566,29 @@ struct {
 	{zoom,          "zoom"},
 };
 
+/* callable functions from outside that act on the connection itself,
+ * and get the rest of the message as-is
+ */
+struct {
+	void (*func)(conn*, char*);
+	const char* str;
+} connfuncs [] = {
+	{beginbatch,    "begin"},
+	{commitbatch,   "commit"},
+	{subscribe,     "subscribe"},
+};
+
+/* callable functions from outside that answer with a one-line JSON reply */
+struct {
+	void (*func)(buffer*);
+	const char* str;
+} queries [] = {
+	{dumpclients,   "clients"},
+	{dumpmonitors,  "monitors"},
+	{dumppools,     "pools"},
+	{dumpstate,     "state"},
+};
+
 
 /* Make the above known */
 #include "config.h"
@@ -312,20 +606,72 @@ static int sw;
 static Cursor cursor;
 static Display* dis;
 static Window root;
+#ifdef XCB
+static xcb_connection_t* xcon; /* same connection, for pipelined requests */
+#endif
 /* for EACHCLIENT/EACHMON iterating */
 client* ic;
 monitor* im;
 Arg parg; /* for parser */
+/* everything the window and monitor churn allocates, see poolget */
+/* a slab's first halves span whole pages, which the prefetcher runs through */
+static pool clientpool = { .name = "clients", .size = LINES(client), .perslab = 256, .split = 1 };
+static pool monpool = { .name = "monitors", .size = sizeof(monitor), .perslab = 8 };
+/* a monitor's desktops, then its state string */
+static pool deskpool = { .name = "desktops",
+	.size = NUMTAGS * sizeof(desktop) + NUMTAGS + 3, .perslab = 8 };
+static pool* pools[] = { &clientpool, &monpool, &deskpool };
 /* Monitor Interfacing */
 static monitor* curmon;
 static monitor* mhead;
+/* Window -> client, see hashclient */
+static client** wintab;
+static unsigned int wintabsize, nhashed;
+/* sarasock interfacing */
+static conn* chead;
+static conn sconn, xconn; /* epoll tags for the listening socket and X */
+static int epfd;
+static conn* batching; /* whose batch the command being run is part of */
+#ifdef SHMRING
+static ring* cmdring;
+static conn rconn; /* epoll tag for INPUTWAKE */
+#endif
+static Window lastfocus; /* for pushevent */
+/* Hover intent: where the pointer last went, and when to focus it (ms) */
+static Window hoverwin;
+static long hoverdue;
+#ifdef _SHAPE_H_
+/* Rounded corners */
+static XRectangle* cornerbands; /* top corner spans: x inset, y, height */
+static XRectangle* cornerrects; /* scratch for roundcorners */
+static int ncornerbands;
+#endif
 /* Backend */
 static int restart;
 static int running;
+/* startup timing in microseconds, reported after the first arrange */
+static long tpremain, tstart, topen, tsetup, tadopt, tlisten;
 static const Arg dumbarg; /* passthrough for function calls like togglefs */
 static long w_data[] = { WithdrawnState, None }; /* for unmanage and unmapnotify */
-static Atom w_atom; /* for unmanage and unmapnotify */
-static XEvent dumbev; /* for XCheckMasking */
+static Atom wmatom[WMLast]; /* see internatoms */
+static const char* wmatomnames[WMLast] = {
+	[WMProtocols] = "WM_PROTOCOLS",
+	[WMDelete] = "WM_DELETE_WINDOW",
+	[WMState] = "WM_STATE",
+	[SaraState] = "SARA_STATE"
+};
+static buffer allstats; /* for setallstats */
+static buffer statusbuf; /* for sendstatus */
+static unsigned long statserial;
+static unsigned long enterserial; /* EnterNotifys older than this are our own doing */
+#ifdef GRABKEYS
+/* the request serial of each grab, and its keys[] entry, see grabkeys */
+static struct {
+	unsigned long serial;
+	int key;
+} keygrabs[2 * TABLENGTH(keys)];
+static int nkeygrabs;
+#endif
 
 
 /* ---------------------------------------
@@ -343,25 +689,62 @@ adjustcoords(client* c){
 	}
 }
 
+/* only ever for curmon, see flushdirty */
+void
+applyfocus(monitor* m){
+	Window w = m->current ? m->current->win : root;
+
+	XSetInputFocus(dis, w, RevertToPointerRoot, CurrentTime);
+
+	if (w != lastfocus){
+		lastfocus = w;
+		pushevent(m, "focus %d %lu", m->num, m->current ? w : None);
+	}
+}
+
+/* only send the server what it doesn't already have */
+void
+applygeom(client* c, int x, int y, int w, int h){
+	unsigned int mask = 0;
+	clientcold* cc = COLD(c);
+	XWindowChanges wc;
+
+	if (x != cc->cx){
+		mask |= CWX;
+		cc->cx = wc.x = x;
+	}
+	if (y != cc->cy){
+		mask |= CWY;
+		cc->cy = wc.y = y;
+	}
+	if (w != cc->cw){
+		mask |= CWWidth;
+		cc->cw = wc.width = w;
+	}
+	if (h != cc->ch){
+		mask |= CWHeight;
+		cc->ch = wc.height = h;
+	}
+
+	if (mask)
+		XConfigureWindow(dis, c->win, mask, &wc);
+}
+
 void
-applyrules(client* c){
+applyrules(client* c, winprops* p){
 	const char* class, * instance;
 	int i;
 	const rule* r;
-	XTextProperty tp;
-	XClassHint ch = { NULL, NULL };
 
 	c->isfloat = c->desks = 0;
 
-	XGetWMName(dis, c->win, &tp);
-	XGetClassHint(dis, c->win, &ch);
-	class = ch.res_class ? ch.res_class : "broken";
-	instance = ch.res_name  ? ch.res_name  : "NULL";
+	class = *p->class ? p->class : "broken";
+	instance = *p->instance ? p->instance : "NULL";
 
 	for (i=0;i < TABLENGTH(rules);i++){
 		r = &rules[i];
 
-		if ((!r->title || (tp.value && strstr(r->title, (const char*) tp.value)))
+		if ((!r->title || (*p->name && strstr(r->title, p->name)))
 		&& (!r->class || strstr(class, r->class))
 		&& (!r->instance || strstr(instance, r->instance))){
 			c->isfloat = r->isfloat;
@@ -377,34 +760,34 @@ applyrules(client* c){
 		}
 	}
 
-	if (ch.res_class)
-		XFree(ch.res_class);
-	if (ch.res_name)
-		XFree(ch.res_name);
-
 	c->desks = c->desks ? c->desks : c->mon->seldesks;
 }
 
 void
 attach(client* c, int aside){
-	client* l;
+	monitor* m = c->mon;
+	client* p;
 
-	if (!aside || !c->mon->head){
-		c->next = c->mon->head;
-		c->mon->head = c;
+	countclient(c, 1);
 
-	} else {
-		/* If not the first on this desktop */
-		if (c->mon->current){
-			c->next = c->mon->current->next;
-			c->mon->current->next = c;
+	/* c goes after p, or first if there is none:
+	 * after current if there is one, else at the end
+	 */
+	p = (!aside || !m->head) ? NULL : m->current ? m->current : m->tail;
 
-		} else {
-			for (l=c->mon->head;l && l->next;l=l->next);
-			if (l)
-				l->next = c;
-		}
-	}
+	c->prev = p;
+	c->next = p ? p->next : m->head;
+	if (c->next)
+		c->next->prev = c;
+	else
+		m->tail = c;
+	if (p)
+		p->next = c;
+	else
+		m->head = c;
+
+	if (!m->visstale && ISVISIBLE(c))
+		visinsert(m, visindex(c), c);
 }
 
 // TODO:
@@ -412,17 +795,30 @@ attach(client* c, int aside){
 // 	m->current = m->prev
 void
 changecurrent(client* c, monitor* m, int desk, int refocused){
+	int i;
 	client* vis;
 
 	if (c){
 		c->iscur ^= 1 << desk;
 		grabbuttons(c, 1);
 	}
-	
-	for EACHCLIENT(m->head){
-		if (ic != c && (ic->iscur & 1 << desk)){
-			ic->iscur ^= 1 << desk;
-			grabbuttons(ic, 0);
+
+	/* only the visible can be current on the current desktop, see setdesks */
+	if (desk == m->curdesk){
+		updatevis(m);
+		for (i=0;i < m->nvis;i++){
+			if ( (vis = m->vis[i]) != c && (vis->iscur & 1 << desk) ){
+				vis->iscur ^= 1 << desk;
+				grabbuttons(vis, 0);
+			}
+		}
+
+	} else {
+		for EACHCLIENT(m->head){
+			if (ic != c && (ic->iscur & 1 << desk)){
+				ic->iscur ^= 1 << desk;
+				grabbuttons(ic, 0);
+			}
 		}
 	}
 
@@ -430,8 +826,9 @@ changecurrent(client* c, monitor* m, int desk, int refocused){
 
 	/* move focus down if possible, else move up */
 	if (m->current && refocused){
-		vis = (vis = findvisclient(c->next, WantFloating))
-			? vis : findprevclient(c, OnlyVis, WantFloating);
+		i = visindex(c);
+		vis = (vis = findvisclient(m, i + !!ISVISIBLE(c), WantFloating))
+			? vis : findprevclient(m, i, WantFloating);
 		changecurrent(vis, m, m->curdesk, 0);
 	}
 
@@ -457,66 +854,118 @@ configure(client* c){
 	XSendEvent(dis, c->win, False, StructureNotifyMask, (XEvent *)&ce);
 }
 
+/* n is 1 on attach, -1 on detach */
 void
-detach(client* c, int refocus_override){
-	client** t;
+countclient(client* c, int n){
+	int i;
 
+	for (i=0;i < NUMTAGS;i++){
+		if (!(c->desks & 1 << i))
+			continue;
+
+		if ( (c->mon->desks[i].nclients += n) )
+			c->mon->occ |= 1 << i;
+		else
+			c->mon->occ &= ~(1 << i);
+	}
+}
+
+void
+detach(client* c, int refocus_override){
 	/* refocus only as necessary */
 	if (c == c->mon->current && !refocus_override)
 		changecurrent(c, c->mon, c->mon->curdesk, 1);
 
-	for (t=&(c->mon->head);*t && *t != c;t=&(*t)->next);
-	*t = c->next;
+	if (!c->mon->visstale && ISVISIBLE(c))
+		visremove(c->mon, visindex(c));
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		c->mon->head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		c->mon->tail = c->prev;
+
+	c->next = c->prev = NULL;
+	countclient(c, -1);
 }
 
 client*
 findclient(Window w){
-	for EACHMON(mhead)
-		for EACHCLIENT(im->head)
-			if (ic->win == w)
-				return ic;
+	client* c;
 
-	return NULL;
+	if (!wintab)
+		return NULL;
+
+	for (c=wintab[WINHASH(w, wintabsize)];c && c->win != w;c=COLD(c)->hnext);
+
+	return c;
 }
 
 client*
 findcurrent(monitor* m){
-	for EACHCLIENT(m->head)
-		if (ISVISIBLE(ic) && (ic->iscur & 1 << m->curdesk))
-			return ic;
+	int i;
+
+	updatevis(m);
+	for (i=0;i < m->nvis;i++)
+		if (m->vis[i]->iscur & 1 << m->curdesk)
+			return m->vis[i];
 
 	return NULL;
 }
 
+/* the last visible client before m->vis[i], see visindex */
 client*
-findprevclient(client* c, int onlyvis, int onlytiled){
-	client* ret = NULL;
-
-	for EACHCLIENT(c->mon->head){
-		if (ic == c)
-			break;
-
-		if (onlyvis && ISVISIBLE(ic))
-			if ((onlytiled && !ic->isfloat) || !onlytiled)
-				ret = ic;
-
-		if (ic->next == c)
-			return (onlyvis) ? ret : ic;
-	}
+findprevclient(monitor* m, int i, int onlytiled){
+	updatevis(m);
+	for (i--;i >= 0;i--)
+		if (!onlytiled || !m->vis[i]->isfloat)
+			return m->vis[i];
 
 	return NULL;
 }
 
+/* the first visible client from m->vis[i] on */
 client*
-findvisclient(client* c, int wantfloat){
-	for EACHCLIENT(c)
-		if (ISVISIBLE(ic))
-			if ((!wantfloat && !ic->isfloat) || wantfloat)
-				return ic;
-	
+findvisclient(monitor* m, int i, int wantfloat){
+	updatevis(m);
+	for (;i < m->nvis;i++)
+		if (wantfloat || !m->vis[i]->isfloat)
+			return m->vis[i];
+
 	return NULL;
 }
 
+/* keep about one client per bucket, so findclient doesn't care how many
+ * there are. sendmon needn't rehash, as the entry is the client itself.
+ */
+void
+hashclient(client* c){
+	unsigned int i, n = wintabsize;
+	client** old = wintab, * t;
+
+	if (nhashed >= wintabsize){
+		wintabsize = n ? 2 * n : 64;
+		wintab = ecalloc(wintabsize, sizeof(client*));
+
+		for (i=0;i < n;i++){
+			while ( (t = old[i]) ){
+				old[i] = COLD(t)->hnext;
+				COLD(t)->hnext = wintab[WINHASH(t->win, wintabsize)];
+				wintab[WINHASH(t->win, wintabsize)] = t;
+			}
+		}
+		free(old);
+	}
+
+	i = WINHASH(c->win, wintabsize);
+	COLD(c)->hnext = wintab[i];
+	wintab[i] = c;
+	nhashed++;
+}
+
 void
 killclient(const Arg arg){
 	if (!curmon->current)
@@ -532,32 +981,32 @@ killclient(const Arg arg){
 }
 
 void
-manage(Window parent, XWindowAttributes* wa){
+manage(winprops* p, int wantfocus){
 	client* c, * t;
-	Window trans = None;
 
-	c = ecalloc(1, sizeof(client));
+	c = poolget(&clientpool);
 
-	if (curmon->current && curmon->current->isfull)
+	if (wantfocus && curmon->current && curmon->current->isfull)
 		togglefs(dumbarg);
 
-	c->win = parent;
+	c->win = p->win;
 	c->isfloat = c->oldfloat = c->isfull = c->iscur = 0;
-	c->x = wa->x;
-	c->y = wa->y;
-	c->w = wa->width;
-	c->h = wa->height;
+	hashclient(c);
+	c->x = COLD(c)->cx = p->x;
+	c->y = COLD(c)->cy = p->y;
+	c->w = COLD(c)->cw = p->w;
+	c->h = COLD(c)->ch = p->h;
 
-	if (XGetTransientForHint(dis, parent, &trans) && (t = findclient(trans))){
+	if (p->trans != None && (t = findclient(p->trans))){
 		c->desks = t->desks;
 		c->mon = t->mon;
 
 	} else {
 		c->mon = curmon;
-		applyrules(c);
+		applyrules(c, p);
 	}
 	if (!c->isfloat)
-		c->isfloat = c->oldfloat = (trans != None);
+		c->isfloat = c->oldfloat = (p->trans != None);
 
 	adjustcoords(c);
 	c->y = (c->y < c->mon->wy) ? c->mon->wy : c->y;
@@ -570,14 +1019,16 @@ manage(Window parent, XWindowAttributes* wa){
 	attach(c, 1);
 
 	/* move out of the way until told otherwise */
-	XMoveResizeWindow(dis, c->win, c->x + 2*sw, c->y, c->w, c->h);
+	applygeom(c, c->x + 2*sw, c->y, c->w, c->h);
 	arrange(c->mon);
-#ifdef _SHAPE_H_
-	roundcorners(c);
-#endif
 	XMapWindow(dis, c->win);
+	pushevent(c->mon, "map %d %lu", c->mon->num, c->win);
 
-	if (c->desks & c->mon->seldesks){
+	/* adopt focuses each monitor once it has everything */
+	if (!wantfocus && c->desks & c->mon->seldesks){
+		c->mon->current = c;
+
+	} else if (c->desks & c->mon->seldesks){
 		changecurrent(c, c->mon, c->mon->curdesk, 0);
 		restack(c->mon);
 
@@ -604,7 +1055,8 @@ moveclient(const Arg arg){
 		return;
 
 	/* move current up, or move next visible up (i.e. move current down) */
-	c = (parg.i > 0) ? curmon->current : findvisclient(curmon->current->next, WantTiled);
+	c = (parg.i > 0) ? curmon->current
+		: findvisclient(curmon, visindex(curmon->current) + 1, WantTiled);
 
 	if (c){
 		moveclientup(c);
@@ -614,52 +1066,65 @@ moveclient(const Arg arg){
 
 void
 moveclientup(client* c){
-	client* p = NULL, * target = NULL;
-	client** t = NULL;
+	int i, t;
+	client* target;
+	monitor* m;
 
 	if (!c)
 		return;
+	m = c->mon;
 
-	target = findprevclient(c, OnlyVis, WantTiled);
-	p = findprevclient(c, AnyVis, WantDummy);
-	
 	/* Go up only if not highest visible */
-	if (!target || !p)
+	i = visindex(c);
+	for (t=i - 1;t >= 0 && m->vis[t]->isfloat;t--);
+	if (t < 0)
 		return;
+	target = m->vis[t];
 
- 	for (t=&c->mon->head;*t && *t != target;t=&(*t)->next);
+	/* out from where it was, c->prev is at least target */
+	c->prev->next = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		c->mon->tail = c->prev;
 
-	/* if p == target, then we're still okay */
-	p->next = c->next;
+	/* and back in just above target */
+	c->prev = target->prev;
 	c->next = target;
-	*t = c;
+	if (target->prev)
+		target->prev->next = c;
+	else
+		c->mon->head = c;
+	target->prev = c;
+
+	/* the same in vis, which has it between target and where it was */
+	if (ISVISIBLE(c)){
+		memmove(&m->vis[t + 1], &m->vis[t], (i - t) * sizeof(client*));
+		m->vis[t] = c;
+	}
 }
 
 void
 movefocus(const Arg arg){
-	client* j, * c = NULL;
+	int i;
+	client* c = NULL;
 
 	if (!curmon->current || curmon->current->isfull)
 		return;
 
 	parser[WantInt](arg.s, &parg);
 
-	/* up stack */
-	if (parg.i > 0){
-		for (j=curmon->head;j && j != curmon->current;j=j->next)
-			if (ISVISIBLE(j))
-				c = j;
+	i = visindex(curmon->current);
 
-		/* if curmon->current was highest, go to the bottom */
-		if (!c)
-			for (;j;j=j->next)
-				if (ISVISIBLE(j))
-					c = j;
+	/* up stack, from the highest to the bottom */
+	if (parg.i > 0){
+		if ( !(c = findprevclient(curmon, i, WantFloating)) )
+			c = findprevclient(curmon, curmon->nvis, WantFloating);
 
 	/* down stack, wrap around */
 	} else if (parg.i < 0) {
-		if ( !(c = findvisclient(curmon->current->next, WantFloating)) )
-			c = findvisclient(curmon->head, WantFloating);
+		if ( !(c = findvisclient(curmon, i + 1, WantFloating)) )
+			c = findvisclient(curmon, 0, WantFloating);
 	}
 
 	if (c && c != curmon->current){
@@ -670,17 +1135,27 @@ movefocus(const Arg arg){
 
 void
 manipulate(const Arg arg){
-	int x, y, ocx, ocy, nx, ny, nw, nh;
+	int x, y, ocx, ocy, nx, ny, nw, nh, px = 0, py = 0;
 	client* c;
 	XEvent ev;
-	int doresize = (arg.i == WantResize), trytoggle = 0;
+	int doresize = (arg.i & WantResize), trytoggle = 0, pending = 0;
+	/* WantOutline: drag an XOR frame, and configure c once at the end */
+	int outline = (arg.i & WantOutline), drawn = 0, fx, fy, fw, fh;
+	GC gc = NULL;
+	XGCValues gv = {
+		.function = GXxor,
+		.subwindow_mode = IncludeInferiors,
+		.line_width = 2
+	};
 	monitor* m = NULL;
 	Time lasttime = 0;
 
 	if ( !(c = curmon->current) || c->isfull )
 		return;
 
+	/* the loop below runs its own events, so it settles up as it goes */
 	restack(curmon);
+	flushdirty();
 
 	if (XGrabPointer(dis, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync,
 		None, cursor, CurrentTime) != GrabSuccess)
@@ -695,6 +1170,13 @@ manipulate(const Arg arg){
 		XWarpPointer(dis, None, c->win, 0, 0, 0, 0, c->w + 1, c->h + 1);
 	}
 
+	/* nothing else may draw under the frame, or erasing it leaves a mess */
+	if (outline){
+		gv.foreground = BlackPixel(dis, screen) ^ WhitePixel(dis, screen);
+		gc = XCreateGC(dis, root, GCFunction|GCSubwindowMode|GCLineWidth|GCForeground, &gv);
+		XGrabServer(dis);
+	}
+
 	ocx = c->x;
 	ocy = c->y;
 	do {
@@ -705,17 +1187,33 @@ manipulate(const Arg arg){
 		case MapRequest:
 			events[ev.type](&ev);
 			break;
+		case ButtonRelease:
+			/* land on the last position */
+			if (!pending)
+				break;
+			/* fall through */
 		case MotionNotify:
-			if ((ev.xmotion.time - lasttime) <= (1000 / 60))
-				continue;
-			lasttime = ev.xmotion.time;
+			if (ev.type == MotionNotify){
+				/* only the latest position matters */
+				while (XCheckTypedEvent(dis, MotionNotify, &ev));
+				px = ev.xmotion.x;
+				py = ev.xmotion.y;
+
+				/* at most one configure per frame */
+				if ((ev.xmotion.time - lasttime) < (1000 / dragfps)){
+					pending = 1;
+					break;
+				}
+				lasttime = ev.xmotion.time;
+			}
+			pending = 0;
 
-			/* Only adjust if moving */
-			nx = doresize ? c->x : ocx + (ev.xmotion.x - x);
-			ny = doresize ? c->y : ocy + (ev.xmotion.y - y);
+			/* Only adjust if moving, from where the last frame put it */
+			nx = doresize ? (drawn ? fx : c->x) : ocx + (px - x);
+			ny = doresize ? (drawn ? fy : c->y) : ocy + (py - y);
 			/* Only adjust if resizing */
-			nw = doresize ? MAX(ev.xmotion.x - ocx + 1, 1) : c->w;
-			nh = doresize ? MAX(ev.xmotion.y - ocy + 1, 1) : c->h;
+			nw = doresize ? MAX(px - ocx + 1, 1) : c->w;
+			nh = doresize ? MAX(py - ocy + 1, 1) : c->h;
 
 			/* if c extends beyond the boundaries of its monitor, make it a float */
 			if (doresize && (m->mx + nw >= curmon->mx
@@ -726,26 +1224,60 @@ manipulate(const Arg arg){
 
 			} else {
 				/* if c is within snappx of the monitor borders,
-				 * then snap and make it a float
+				 * then snap and make it a float. c->w and c->h lag
+				 * behind a resize, and an outline never sets them
 				 */
 				nx = (abs(curmon->mx - nx) < snappx) ? curmon->mx : nx;
-				nx = (abs((curmon->mx + curmon->mw) - (nx + c->w)) < snappx)
-					? curmon->mx + curmon->mw - c->w : nx;
+				nx = (abs((curmon->mx + curmon->mw) - (nx + nw)) < snappx)
+					? curmon->mx + curmon->mw - nw : nx;
 				ny = (abs(curmon->wy - ny) < snappx) ? curmon->wy : ny;
-				ny = (abs((curmon->wy + curmon->wh) - (ny + c->h)) < snappx)
-					? curmon->wy + curmon->wh - c->h : ny;
+				ny = (abs((curmon->wy + curmon->wh) - (ny + nh)) < snappx)
+					? curmon->wy + curmon->wh - nh : ny;
 				trytoggle = 1;
 			}
 			/* don't toggle if floating layout, do resize if floating */
 			if (!c->isfloat && trytoggle && !(curmon->curlayout->arrange == &floaty))
 				togglefloat(dumbarg);
-			if (c->isfloat || (curmon->curlayout->arrange == &floaty))
-				resizeclient(c, nx, ny, nw, nh);
-			XFlush(dis);
+			if (outline && (c->isfloat || (curmon->curlayout->arrange == &floaty))){
+				if (drawn)
+					XDrawRectangle(dis, root, gc, fx, fy, fw - 1, fh - 1);
+				/* togglefloat may have moved things about */
+				flushdirty();
+				fx = nx;
+				fy = ny;
+				fw = nw;
+				fh = nh;
+				XDrawRectangle(dis, root, gc, fx, fy, fw - 1, fh - 1);
+				drawn = 1;
+
+			/* the corners wait for the release */
+			} else if (c->isfloat || (curmon->curlayout->arrange == &floaty)){
+				c->x = nx;
+				c->y = ny;
+				c->w = nw;
+				c->h = nh;
+				applygeom(c, nx, ny, nw, nh);
+			}
 			break;
 		}
+
+		/* XMaskEvent flushes for us before it blocks */
+		flushdirty();
 	} while (ev.type != ButtonRelease);
 
+	if (outline){
+		if (drawn){
+			XDrawRectangle(dis, root, gc, fx, fy, fw - 1, fh - 1);
+			c->x = fx;
+			c->y = fy;
+			c->w = fw;
+			c->h = fh;
+			applygeom(c, fx, fy, fw, fh);
+		}
+		XUngrabServer(dis);
+		XFreeGC(dis, gc);
+	}
+
 	if (doresize)
 		XWarpPointer(dis, None, c->win, 0, 0, 0, 0, c->w + 1, c->h + 1);
 	XUngrabPointer(dis, CurrentTime);
@@ -765,14 +1297,11 @@ manipulate(const Arg arg){
 
 void
 resizeclient(client* c, int x, int y, int w, int h){
-	XWindowChanges wc;
-
-	c->x = wc.x = x;
-	c->y = wc.y = y;
-	c->w = wc.width = w;
-	c->h = wc.height = h;
-	XConfigureWindow(dis, c->win, CWX|CWY|CWWidth|CWHeight, &wc);
-	XSync(dis, False);
+	c->x = x;
+	c->y = y;
+	c->w = w;
+	c->h = h;
+	applygeom(c, x, y, w, h);
 #ifdef _SHAPE_H_
 	roundcorners(c);
 #endif
@@ -780,41 +1309,83 @@ resizeclient(client* c, int x, int y, int w, int h){
 
 void
 restack(monitor* m){
-	XWindowChanges wc;
+	markdirty(m, DirtyStack);
+}
 
-	if (!m->current)
+/* Retag an attached client. Leaving a desktop drops its currentness
+ * there, so whoever is current on the current desktop is visible.
+ */
+void
+setdesks(client* c, unsigned int desks){
+	monitor* m = c->mon;
+	int i = (!m->visstale && ISVISIBLE(c)) ? visindex(c) : -1;
+
+	countclient(c, -1);
+	c->desks = desks;
+	c->iscur &= desks;
+	countclient(c, 1);
+
+	if (m->visstale)
 		return;
 
-	wc.stack_mode = Below;
-	wc.sibling = m->current->win;
+	if (i < 0 && ISVISIBLE(c)){
+		visinsert(m, visindex(c), c);
 
-	for EACHCLIENT(m->head){
-		//if (ic != m->current && !ic->isfloat && ISVISIBLE(ic)){
-		// if not current, and visible, and both are floating or neither are floating
-		if (ic != m->current && ISVISIBLE(ic) && (ic->isfloat == m->current->isfloat)){
-			XConfigureWindow(dis, ic->win, CWSibling|CWStackMode, &wc);
-			wc.sibling = ic->win;
-		}
+	} else if (i >= 0 && !ISVISIBLE(c)){
+		visremove(m, i);
+		/* for updatevis to park */
+		if (c->shown)
+			m->visstale = 1;
 	}
-
-	XSync(dis, False);
-	while (XCheckMaskEvent(dis, EnterWindowMask, &dumbev));
 }
 
+/* updatevis parks whoever is no longer visible */
 void
 showhide(monitor* m){
-	for EACHCLIENT(m->head){
-		if (ISVISIBLE(ic)){
-			XMoveWindow(dis, ic->win, ic->x, ic->y);
-			if (ic->isfloat && !ic->isfull){
-				resizeclient(ic, ic->x, ic->y, ic->w, ic->h);
-				XRaiseWindow(dis, ic->win);
-			}
+	int i;
+	client* c;
 
-		} else {
-			XMoveWindow(dis, ic->win, -2*ic->w, ic->y);
+	updatevis(m);
+	for (i=0;i < m->nvis;i++){
+		c = m->vis[i];
+		c->shown = 1;
+		applygeom(c, c->x, c->y, COLD(c)->cw, COLD(c)->ch);
+		if (c->isfloat && !c->isfull){
+			resizeclient(c, c->x, c->y, c->w, c->h);
+			XRaiseWindow(dis, c->win);
+		}
+	}
+}
+
+void
+stackclients(monitor* m){
+	int i;
+	client* c;
+	XWindowChanges wc;
+
+	if (!m->current)
+		return;
+
+	wc.stack_mode = Below;
+	wc.sibling = m->current->win;
+
+	updatevis(m);
+	for (i=0;i < m->nvis;i++){
+		c = m->vis[i];
+		// if not current, and both are floating or neither are floating
+		if (c != m->current && (c->isfloat == m->current->isfloat)){
+			XConfigureWindow(dis, c->win, CWSibling|CWStackMode, &wc);
+			wc.sibling = c->win;
 		}
 	}
+
+	/* Rather than XSync and throw away the EnterNotifys that shuffling
+	 * windows under the pointer causes, remember where our requests end.
+	 * The marker has to be a real request, or later events would share
+	 * the last restack's serial.
+	 */
+	enterserial = NextRequest(dis);
+	XNoOp(dis);
 }
 
 void
@@ -826,7 +1397,6 @@ sendmon(client* c, monitor* m){
 	c->mon = m;
 	c->desks = m->seldesks;
 
-	c->next = NULL;
 	attach(c, 1);
 	c->iscur = 0;
 	changecurrent(c, c->mon, c->mon->curdesk, 0);
@@ -852,9 +1422,9 @@ todesktop(const Arg arg){
 	if (curmon->current->desks == (1 << parg.i))
 		return;
 
-	curmon->current->desks = 1 << parg.i;
+	setdesks(curmon->current, 1 << parg.i);
 	curmon->current->iscur = 0;
-	changecurrent(curmon->current, curmon, 1 << parg.i, 1);
+	changecurrent(curmon->current, curmon, parg.i, 1);
 
 	arrange(curmon);
 	outputstats();
@@ -878,7 +1448,7 @@ toggledesktop(const Arg arg){
 		newdesks = curmon->current->desks ^ (1 << parg.i);
 
 	if (newdesks){
-		curmon->current->desks = newdesks;
+		setdesks(curmon->current, newdesks);
 		/* set current to be current on new desktop
 		 * if it will no longer be visible, adjust current
 		 */
@@ -935,35 +1505,42 @@ tomon(const Arg arg){
 	outputstats();
 }
 
+void
+unhashclient(client* c){
+	client** t;
+
+	for (t=&wintab[WINHASH(c->win, wintabsize)];*t && *t != c;t=&COLD(*t)->hnext);
+	if (*t){
+		*t = COLD(c)->hnext;
+		nhashed--;
+	}
+}
+
 void
 unmanage(client* c, int destroyed){
 	monitor* m = c->mon;
 
+	pushevent(m, "unmap %d %lu", m->num, c->win);
 	detach(c, 0);
+	unhashclient(c);
 	if (!destroyed){
 		XGrabServer(dis);
 		XUngrabButton(dis, AnyButton, AnyModifier, c->win);
-		XChangeProperty(dis, c->win, w_atom, w_atom, 32,
+		XChangeProperty(dis, c->win, wmatom[WMState], wmatom[WMState], 32,
 				PropModeReplace, (unsigned char*) w_data, 2);
 		XSync(dis, False);
 		XUngrabServer(dis);
 	}
-	free(c);
+	poolput(&clientpool, c);
 	arrange(m);
 	outputstats();
 }
 
+/* the work itself happens once, in flushdirty */
 void
 updatefocus(monitor* m){
-	if (!m)
-		return;
-
-	if (m->current)
-		XSetInputFocus(dis, m->current->win, RevertToPointerRoot, CurrentTime);
-	else
-		XSetInputFocus(dis, root, RevertToPointerRoot, CurrentTime);
-
-	XSync(dis, False);
+	if (m)
+		markdirty(m, DirtyFocus);
 }
 
 void
@@ -984,11 +1561,44 @@ zoom(const Arg arg){
  * ---------------------------------------
  */
 
+/* Hand the layout the tiled clients, and only bother the server (or
+ * round any corners) for those whose rect actually changed.
+ */
+void
+applylayout(monitor* m){
+	int i, j, n = 0;
+	client* c;
+	rect* r;
+
+	updatevis(m);
+	for (i=0;i < m->nvis;i++)
+		n += !m->vis[i]->isfloat;
+
+	n = m->curlayout->arrange(m, n, m->rects);
+	for (i=0, j=0;i < m->nvis;i++){
+		if ( (c = m->vis[i])->isfloat )
+			continue;
+
+		/* whoever the layout leaves be, like everyone under floaty,
+		 * keeps their geometry but still wants corners
+		 */
+		if (j >= n){
+#ifdef _SHAPE_H_
+			roundcorners(c);
+#endif
+			continue;
+		}
+
+		r = &m->rects[j++];
+		if (!c->isfull && (r->x != c->x || r->y != c->y || r->w != c->w || r->h != c->h))
+			resizeclient(c, r->x, r->y, r->w, r->h);
+	}
+}
+
+/* the work itself happens once, in flushdirty */
 void
 arrange(monitor* m){
-	showhide(m);
-	m->curlayout->arrange(m);
-	restack(m);
+	markdirty(m, DirtyVis|DirtyLayout|DirtyStack);
 };
 
 void
@@ -1002,11 +1612,54 @@ changemsize(const Arg arg){
 }
 
 /* don't toggle isfloat, so that everyone snaps back when you tile, etc. */
+int
+floaty(const monitor* m, int n, rect* r){
+	return 0;
+}
+
+/* Settle up, once, whatever this trip around the event loop put off,
+ * so a burst of events or messages costs one relayout per monitor.
+ * Monitors an open batch has touched wait for its commit, X or not,
+ * and so do the focus and the events they'd push. Focus only ever
+ * follows curmon, whichever monitor asked for it last.
+ */
 void
-floaty(monitor* m){
-	for EACHCLIENT(m->head)
-		if (ISVISIBLE(ic))
-			resizeclient(ic, ic->x, ic->y, ic->w, ic->h);
+flushdirty(){
+	int changed = 0;
+	monitor* m;
+
+	for (m=mhead;m;m=m->next){
+		if (isheld(m))
+			continue;
+		if (m->dirty & DirtyVis)
+			showhide(m);
+		if (m->dirty & DirtyLayout)
+			applylayout(m);
+		if (m->dirty & DirtyStack)
+			stackclients(m);
+		if ((m->dirty & DirtyFocus) && m == curmon)
+			applyfocus(m);
+		if (m->events.len)
+			sendevents(m);
+		if (m->dirty & DirtyStatus)
+			changed |= updatestats(m);
+		m->dirty = 0;
+	}
+
+	if (changed && allstate)
+		setallstats();
+}
+
+/* whether an open batch holds m back, see markdirty */
+int
+isheld(monitor* m){
+	conn* c;
+
+	for (c=chead;c;c=c->next)
+		if (c->inbatch && (c->held & MONBIT(m)))
+			return 1;
+
+	return 0;
 }
 
 void
@@ -1018,12 +1671,22 @@ loaddesktop(int i){
 	curmon->curlayout = curmon->desks[i].curlayout;
 }
 
+/* left for flushdirty, and for the batch that's running to commit */
 void
-monocle(monitor* m){
-	int x = m->mx + gappx, y = (bottombar ? (m->my + gappx) : (m->wy + barpx)), max_h = (bottombar ? (m->wh - barpx) : (m->mh - gappx));
-	for EACHCLIENT(m->head)
-		if (ISVISIBLE(ic) && !ic->isfloat && !ic->isfull)
-			resizeclient(ic, x, y, m->mw - 2*gappx, max_h - y);
+markdirty(monitor* m, int bits){
+	m->dirty |= bits;
+	if (batching)
+		batching->held |= MONBIT(m);
+}
+
+int
+monocle(const monitor* m, int n, rect* r){
+	int i, x = m->mx + gappx, y = (bottombar ? (m->my + gappx) : (m->wy + barpx)), max_h = (bottombar ? (m->wh - barpx) : (m->mh - gappx));
+
+	for (i=0;i < n;i++)
+		r[i] = (rect) {x, y, m->mw - 2*gappx, max_h - y};
+
+	return n;
 }
 
 void
@@ -1037,45 +1700,29 @@ setlayout(const Arg arg){
 	outputstats();
 }
 
-void
-tile(monitor* m){
-	int n = 0, i = 0, h = 0, x = m->mx + gappx, y = (bottombar ? (m->my + gappx) : (m->wy + barpx)), max_h = (bottombar ? (m->wh - barpx) : (m->mh - gappx));
-	client* nf = NULL;
-
-	/* Find the first non-floating, visible window and tally non-floating, visible windows */
-	for EACHCLIENT(m->head){
-		if (!ic->isfloat && ISVISIBLE(ic)){
-			nf = (!nf) ? ic : nf;
-			n++;
-		}
-	}
-
-	if (nf && n == 1){
-		if (!nf->isfull)
-			resizeclient(nf, x, y, m->mw - 2*gappx, max_h - y);
-
-	} else if (nf){
-		/* so having a master doesn't affect stack splitting */
-		n--;
+int
+tile(const monitor* m, int n, rect* r){
+	int i, h, x = m->mx + gappx, y = (bottombar ? (m->my + gappx) : (m->wy + barpx)), max_h = (bottombar ? (m->wh - barpx) : (m->mh - gappx));
 
-		/* Master window */
-		if (!nf->isfull)
-			resizeclient(nf, x, y, m->msize - gappx, max_h - y);
+	if (n == 1)
+		r[0] = (rect) {x, y, m->mw - 2*gappx, max_h - y};
 
-		/* Stack */
-		for EACHCLIENT(nf->next){
-			if (ISVISIBLE(ic) && !ic->isfloat && !ic->isfull){
-				h = (max_h - y) / (n - i);
+	if (n <= 1)
+		return n;
 
-				resizeclient(ic, x + m->msize, y, m->mw - m->msize - 2*gappx, h);
+	/* Master window */
+	r[0] = (rect) {x, y, m->msize - gappx, max_h - y};
 
-				if (y + h < max_h)
-					y += h + gappx;
+	/* Stack, where having a master doesn't affect the splitting */
+	for (i=1;i < n;i++){
+		h = (max_h - y) / (n - i);
+		r[i] = (rect) {x + m->msize, y, m->mw - m->msize - 2*gappx, h};
 
-				i++;
-			}
-		}
+		if (y + h < max_h)
+			y += h + gappx;
 	}
+
+	return n;
 }
 
 void
@@ -1101,6 +1748,7 @@ toggleview(const Arg arg){
 		togglefs(dumbarg);
 
 	curmon->seldesks ^= tagmask;
+	curmon->visstale = 1;
 
 	if (!(curmon->seldesks & 1 << curmon->curdesk)){
 		for (i=0;i < NUMTAGS;i++){
@@ -1120,6 +1768,33 @@ toggleview(const Arg arg){
 	outputstats();
 }
 
+/* Clients only come, go, move or retag through attach, detach, setdesks
+ * and moveclientup, which keep the visible list as they go. It is only
+ * rebuilt when seldesks changes, or a client on screen is retagged out
+ * of view and has to be parked. Parked clients are only walked then.
+ */
+void
+updatevis(monitor* m){
+	client* c;
+
+	if (!m->visstale)
+		return;
+
+	m->nvis = 0;
+	for (c=m->head;c;c=c->next){
+		if (ISVISIBLE(c)){
+			visinsert(m, m->nvis, c);
+
+		/* newly out of view */
+		} else if (c->shown){
+			c->shown = 0;
+			applygeom(c, -2*c->w, c->y, COLD(c)->cw, COLD(c)->ch);
+		}
+	}
+
+	m->visstale = 0;
+}
+
 void
 view(const Arg arg){
 	client* c;
@@ -1134,13 +1809,14 @@ view(const Arg arg){
 
 	loaddesktop(parg.i);
 	curmon->seldesks = 1 << parg.i;
+	curmon->visstale = 1;
 	curmon->curdesk = parg.i;
 
 	if ( (c = findcurrent(curmon)) )
 		/* rezero, so it can be set and everyone else unset */
 		c->iscur ^= 1 << curmon->curdesk;
 	else
-		c = findvisclient(curmon->head, WantFloating);
+		c = findvisclient(curmon, 0, WantFloating);
 		
 	changecurrent(c, curmon, curmon->curdesk, 0);
 
@@ -1148,6 +1824,45 @@ view(const Arg arg){
 	outputstats();
 }
 
+/* Where c is in m->vis, or would go, which is after every visible client
+ * before it. Only the out of view clients just before c are walked.
+ */
+int
+visindex(client* c){
+	int i;
+	client* p;
+	monitor* m = c->mon;
+
+	updatevis(m);
+	if (!m->nvis)
+		return 0;
+
+	for (p=c->prev;p && !ISVISIBLE(p);p=p->prev);
+	if (!p)
+		return 0;
+
+	for (i=0;m->vis[i] != p;i++);
+	return i + 1;
+}
+
+void
+visinsert(monitor* m, int i, client* c){
+	if (m->nvis == m->vissize){
+		m->vissize = m->vissize ? 2 * m->vissize : 16;
+		if ( !(m->vis = realloc(m->vis, m->vissize * sizeof(client*)))
+				|| !(m->rects = realloc(m->rects, m->vissize * sizeof(rect))) )
+			die("realloc failed");
+	}
+
+	memmove(&m->vis[i + 1], &m->vis[i], (m->nvis++ - i) * sizeof(client*));
+	m->vis[i] = c;
+}
+
+void
+visremove(monitor* m, int i){
+	memmove(&m->vis[i], &m->vis[i + 1], (--m->nvis - i) * sizeof(client*));
+}
+
 
 /* ---------------------------------------
  * Monitor Manipulation
@@ -1165,8 +1880,11 @@ changemon(monitor* m, int wantfocus){
 
 void
 cleanupmon(monitor* m){
-	free(m->desks);
-	free(m);
+	poolput(&deskpool, m->desks);
+	free(m->events.s);
+	free(m->vis);
+	free(m->rects);
+	poolput(&monpool, m);
 }
 
 monitor*
@@ -1181,7 +1899,7 @@ coordstomon(int x, int y){
 monitor*
 createmon(int num, int x, int y, int w, int h){
 	int i;
-	monitor* m = ecalloc(1, sizeof(monitor));
+	monitor* m = poolget(&monpool);
 
 	m->num = num;
 	m->mx = x;
@@ -1196,16 +1914,19 @@ createmon(int num, int x, int y, int w, int h){
 	m->curlayout = (layout*) &layouts[0];
 	m->msize = m->mw * MASTER_SIZE;
 
-	m->desks = ecalloc(NUMTAGS, sizeof(desktop));
+	m->desks = poolget(&deskpool);
+	m->state = (char*) (m->desks + NUMTAGS);
 	for (i=0;i < NUMTAGS;i++){
 		m->desks[i].curlayout = m->curlayout;
 		m->desks[i].msize = m->msize;
 	}
 
 	/* Default to first desktop */
+	m->dirty = DIRTYALL;
 	m->seldesks = 1 << 0;
+	m->visstale = 1;
 	m->curdesk = 0;
-	m->head = NULL;
+	m->head = m->tail = NULL;
 	m->current = NULL;
 
 	return m;
@@ -1231,12 +1952,9 @@ dirtomon(int dir){
 
 monitor*
 findmon(Window w){
-	for EACHMON(mhead)
-		for EACHCLIENT(im->head)
-			if (ic->win == w)
-				return im;
+	client* c;
 
-	return curmon;
+	return (c = findclient(w)) ? c->mon : curmon;
 }
 
 void
@@ -1268,7 +1986,7 @@ void
 updategeom(){
 	int x, y;
 	client* c;
-	monitor* m, * oldmhead = mhead;
+	monitor* m, * nm, * oldmhead = mhead;
 
 #ifdef XINERAMA
 	if (XineramaIsActive(dis)){
@@ -1300,16 +2018,28 @@ updategeom(){
 		mhead = createmon(0, 0, 0, sw, sh);
 	}
 
+	internatoms();
+
 	/* if updating, reattach any old clients to the new mhead */
-	while ( (m = oldmhead) ){
+	for (nm=mhead;(m = oldmhead);){
 		while ( (c = m->head) ){
-			m->head = c->next;
 			detach(c, 0);
 			c->mon = mhead;
-			c->next = NULL;
 			attach(c, 1);
 		}
 		mhead->seldesks |= m->seldesks;
+		mhead->visstale = 1;
+
+		/* pass the arrays on, rather than free them and grow new ones */
+		if (nm){
+			nm->vis = m->vis;
+			nm->rects = m->rects;
+			nm->vissize = m->vissize;
+			m->vis = NULL;
+			m->rects = NULL;
+			nm = nm->next;
+		}
+
 		oldmhead = m->next;
 		cleanupmon(m);
 	}
@@ -1334,6 +2064,7 @@ updategeom(){
  */
 void
 cleanup(){
+	int i;
 	monitor* m, * tm = mhead;
 	const Arg arg = {.s = "-1"};
 
@@ -1342,6 +2073,7 @@ cleanup(){
 		changemon(m, NoFocus);
 		/* make everything visible */
 		toggleview(arg);
+		flushdirty();
 		while (curmon->current)
 			unmanage(curmon->current, 0);
 	}
@@ -1354,11 +2086,153 @@ cleanup(){
 	}
 
 	XFreeCursor(dis, cursor);
+	free(allstats.s);
+	free(statusbuf.s);
+	free(wintab);
+	for (i=0;i < TABLENGTH(pools);i++)
+		poolfree(pools[i]);
+#ifdef _SHAPE_H_
+	free(cornerbands);
+	free(cornerrects);
+#endif
 
 	XSync(dis, False);
 	XSetInputFocus(dis, PointerRoot, RevertToPointerRoot, CurrentTime);
 }
 
+/* fill in p[0..n) for manage. With XCB every request for every window
+ * goes out before the first reply is read, so this costs one round trip
+ * however many windows are asked about. The cookies for a single window,
+ * as for every MapRequest, live on the stack.
+ */
+#ifdef XCB
+void
+fetchprops(winprops* p, int n){
+	int i, len;
+	char* v;
+	struct {
+		xcb_get_window_attributes_cookie_t attr;
+		xcb_get_geometry_cookie_t geom;
+		xcb_get_property_cookie_t trans, name, class;
+	} one, * ck = (n == 1) ? &one : ecalloc(n, sizeof(*ck));
+	xcb_get_window_attributes_reply_t* ar;
+	xcb_get_geometry_reply_t* gr;
+	xcb_get_property_reply_t* pr;
+	xcb_generic_error_t* e;
+
+	/* keep our requests behind anything Xlib has buffered */
+	XFlush(dis);
+
+	for (i=0;i < n;i++){
+		ck[i].attr = xcb_get_window_attributes(xcon, p[i].win);
+		ck[i].geom = xcb_get_geometry(xcon, p[i].win);
+		ck[i].trans = xcb_get_property(xcon, 0, p[i].win, XCB_ATOM_WM_TRANSIENT_FOR,
+			XCB_ATOM_WINDOW, 0, 1);
+		ck[i].name = xcb_get_property(xcon, 0, p[i].win, XCB_ATOM_WM_NAME,
+			XCB_GET_PROPERTY_TYPE_ANY, 0, sizeof(p->name) / 4);
+		ck[i].class = xcb_get_property(xcon, 0, p[i].win, XCB_ATOM_WM_CLASS,
+			XCB_ATOM_STRING, 0, sizeof(p->class) / 4);
+	}
+
+	/* every reply has to be collected, even for windows that went away */
+	for (i=0;i < n;i++){
+		p[i].trans = None;
+		*p[i].name = *p[i].class = *p[i].instance = '\0';
+
+		if ( (ar = xcb_get_window_attributes_reply(xcon, ck[i].attr, &e)) ){
+			p[i].override_redirect = ar->override_redirect;
+			p[i].viewable = (ar->map_state == XCB_MAP_STATE_VIEWABLE);
+		}
+		free(e);
+
+		if ( (gr = xcb_get_geometry_reply(xcon, ck[i].geom, &e)) ){
+			p[i].x = gr->x;
+			p[i].y = gr->y;
+			p[i].w = gr->width;
+			p[i].h = gr->height;
+		}
+		free(e);
+		p[i].ok = (ar && gr);
+		free(ar);
+		free(gr);
+
+		if ( (pr = xcb_get_property_reply(xcon, ck[i].trans, &e)) ){
+			if (pr->type == XCB_ATOM_WINDOW && xcb_get_property_value_length(pr) >= 4)
+				p[i].trans = *(xcb_window_t*) xcb_get_property_value(pr);
+			free(pr);
+		}
+		free(e);
+
+		if ( (pr = xcb_get_property_reply(xcon, ck[i].name, &e)) ){
+			snprintf(p[i].name, sizeof(p->name), "%.*s",
+				xcb_get_property_value_length(pr), (char*) xcb_get_property_value(pr));
+			free(pr);
+		}
+		free(e);
+
+		/* "instance\0class\0" */
+		if ( (pr = xcb_get_property_reply(xcon, ck[i].class, &e)) ){
+			v = xcb_get_property_value(pr);
+			len = xcb_get_property_value_length(pr);
+			snprintf(p[i].instance, sizeof(p->instance), "%.*s", len, v);
+			len -= strlen(p[i].instance) + 1;
+			if (len > 0)
+				snprintf(p[i].class, sizeof(p->class), "%.*s", len, v + strlen(p[i].instance) + 1);
+			free(pr);
+		}
+		free(e);
+	}
+
+	if (ck != &one)
+		free(ck);
+}
+#else
+void
+fetchprops(winprops* p, int n){
+	int i;
+	XWindowAttributes wa;
+	XTextProperty tp;
+	XClassHint ch;
+
+	for (i=0;i < n;i++){
+		p[i].trans = None;
+		*p[i].name = *p[i].class = *p[i].instance = '\0';
+
+		if ( !(p[i].ok = XGetWindowAttributes(dis, p[i].win, &wa)) )
+			continue;
+
+		p[i].override_redirect = wa.override_redirect;
+		p[i].viewable = (wa.map_state == IsViewable);
+		p[i].x = wa.x;
+		p[i].y = wa.y;
+		p[i].w = wa.width;
+		p[i].h = wa.height;
+
+		/* not worth the round trips for windows that won't be managed */
+		if (wa.override_redirect)
+			continue;
+
+		XGetTransientForHint(dis, p[i].win, &p[i].trans);
+
+		if (XGetWMName(dis, p[i].win, &tp) && tp.value){
+			snprintf(p[i].name, sizeof(p->name), "%s", (char*) tp.value);
+			XFree(tp.value);
+		}
+
+		if (XGetClassHint(dis, p[i].win, &ch)){
+			if (ch.res_name){
+				snprintf(p[i].instance, sizeof(p->instance), "%s", ch.res_name);
+				XFree(ch.res_name);
+			}
+			if (ch.res_class){
+				snprintf(p[i].class, sizeof(p->class), "%s", ch.res_class);
+				XFree(ch.res_class);
+			}
+		}
+	}
+}
+#endif
+
 int
 getptrcoords(int* x, int* y){
 	int di;
@@ -1387,49 +2261,76 @@ grabbuttons(client* c, int focused){
 					GrabModeAsync, GrabModeSync, None, None);
 }
 
+#ifdef GRABKEYS
+/* keygrabs remembers which entry each XGrabKey was for, so xerror can
+ * name a key that some other client (like sxhkd) already has. The serial
+ * is taken right at each grab, since XKeysymToKeycode may send requests
+ * of its own.
+ */
 void
-outputstats(){
-	char* isdeskocc, * isdesksel, monstate[NUMTAGS+3];
-	int i;
-	unsigned int occ, sel;
+grabkeys(){
+	int i, j;
+	KeyCode code;
+	unsigned int modifiers[] = { 0, LockMask };
 
-	/* output:
-	 * "0:SONNNNNNN:Y"
-	 * im->num:SEL/OCC/EMPTY:curlayout->symbol
-	 */
-	for EACHMON(mhead){
-		occ = sel = 0;
-		isdeskocc = ecalloc(NUMTAGS, sizeof(char));
-		isdesksel = ecalloc(NUMTAGS, sizeof(char));
-		sel = im->seldesks;
-
-		for EACHCLIENT(im->head)
-			occ |= ic->desks;
-
-		/* uis get reordered in the dest string so they are left-to-right */
-		uitos(occ, NUMTAGS, isdeskocc);
-		uitos(sel, NUMTAGS, isdesksel);
-
-		for (i=0;i<NUMTAGS;i++){
-			if (isdesksel[i] == '1'){
-				monstate[i] = 'S';
-			} else if (isdeskocc[i] == '1'){
-				monstate[i] = 'O';
-			} else {
-				monstate[i] = 'N';
-			}
+	XUngrabKey(dis, AnyKey, AnyModifier, root);
+
+	nkeygrabs = 0;
+	for (i=0;i < TABLENGTH(keys);i++){
+		if ( !(code = XKeysymToKeycode(dis, keys[i].keysym)) )
+			continue;
+
+		for (j=0;j < TABLENGTH(modifiers);j++){
+			/* only the first of each key is worth reporting */
+			keygrabs[nkeygrabs].serial = NextRequest(dis);
+			keygrabs[nkeygrabs++].key = j ? -1 : i;
+			XGrabKey(dis, code, keys[i].mod | modifiers[j], root,
+					True, GrabModeAsync, GrabModeAsync);
 		}
-		monstate[NUMTAGS] = ':';
-		monstate[NUMTAGS+1] = im->curlayout->letter;
-		monstate[NUMTAGS+2] = '\0';
+	}
+}
+#endif
+
+/* every atom we use in one round trip: the WM ones and
+ * SARA_MONSTATE_<num> for each monitor, redone with the monitors
+ */
+void
+internatoms(){
+	int i, n = WMLast;
+	char** names;
+	Atom* atoms;
+	monitor* m;
 
-		setrootstats(monstate, im->num);
+	for (m=mhead;m;m=m->next)
+		n++;
 
-		free(isdeskocc);
-		free(isdesksel);
+	names = ecalloc(n, sizeof(char*));
+	atoms = ecalloc(n, sizeof(Atom));
+
+	for (i=0;i < WMLast;i++)
+		names[i] = (char*) wmatomnames[i];
+	for (m=mhead;m;m=m->next, i++){
+		names[i] = ecalloc(32, sizeof(char));
+		snprintf(names[i], 32, "SARA_MONSTATE_%d", m->num);
 	}
 
-	fflush(stdout);
+	XInternAtoms(dis, names, n, False, atoms);
+
+	for (i=0;i < WMLast;i++)
+		wmatom[i] = atoms[i];
+	for (m=mhead;m;m=m->next, i++){
+		m->stateatom = atoms[i];
+		free(names[i]);
+	}
+
+	free(names);
+	free(atoms);
+}
+
+void
+outputstats(){
+	for EACHMON(mhead)
+		markdirty(im, DirtyStatus);
 }
 
 /* à la BSPWM */
@@ -1453,21 +2354,45 @@ runconfig(){
 }
 
 
+/* every monitor in one property, behind a serial that only moves
+ * when something did:
+ * "serial\nnum:SONNNNNNN:Y\n..."
+ */
+void
+setallstats(){
+	monitor* m;
+
+	allstats.len = 0;
+	bufprintf(&allstats, "%lu\n", ++statserial);
+	for (m=mhead;m;m=m->next)
+		bufprintf(&allstats, "%d:%s\n", m->num, m->state);
+
+	XChangeProperty(dis, root, wmatom[SaraState], XA_STRING, 8, PropModeReplace,
+			(unsigned char*) allstats.s, allstats.len);
+}
+
 /* This man is a god
  * https://jonas-langlotz.de/2020/10/05/polybar-on-dwm
  */
 void
-setrootstats(char* monstate, int monnum){
-	char* atom = malloc(sizeof(char) * 40);
-	char* num = malloc(sizeof(char) * 12);
-	sprintf(atom, "%s", "");
-	sprintf(num, "%d", monnum);
-	strcat(atom, "SARA_MONSTATE_");
-	strcat(atom, num);
-	strcat(atom, "\0");
-	XChangeProperty(dis, root, XInternAtom(dis, atom, False),
-			XA_STRING, 8, PropModeReplace, (unsigned char*) monstate,
-			NUMTAGS+3);
+setrootstats(monitor* m, char* monstate){
+	XChangeProperty(dis, root, m->stateatom, XA_STRING, 8, PropModeReplace,
+			(unsigned char*) monstate, NUMTAGS+3);
+}
+
+/* the pointer stayed put for hoverms, so now focus what it's over */
+void
+settlehover(){
+	client* c = findclient(hoverwin);
+
+	hoverwin = None;
+	if (!c || !ISVISIBLE(c) || c == curmon->current)
+		return;
+
+	if (c->mon != curmon)
+		changemon(c->mon, YesFocus);
+
+	changecurrent(c, c->mon, c->mon->curdesk, 0);
 }
 
 void
@@ -1476,6 +2401,9 @@ setup(){
 
 	screen = DefaultScreen(dis);
 	root = RootWindow(dis, screen);
+#ifdef XCB
+	xcon = XGetXCBConnection(dis);
+#endif
 
 	sw = XDisplayWidth(dis, screen);
 	sh = XDisplayHeight(dis, screen);
@@ -1491,7 +2419,9 @@ setup(){
 	loaddesktop(0);
 	outputstats();
 
-	w_atom = XInternAtom(dis, "WM_STATE", False);
+#ifdef _SHAPE_H_
+	initcorners();
+#endif
 
 	wa.cursor = cursor;
 	wa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask
@@ -1499,65 +2429,231 @@ setup(){
 		|StructureNotifyMask|PropertyChangeMask;
 	XChangeWindowAttributes(dis, root, CWEventMask|CWCursor, &wa);
 	XSelectInput(dis, root, wa.event_mask);
+#ifdef GRABKEYS
+	grabkeys();
+#endif
 }
 
 /* many thanks to bspwm, geeksforgeeks, Beej for sockets */
 void
 start(){
-	int nbytes;
-	char msg[MAXBUFF];
-	fd_set desc;
+	int i, n, pending, timeout;
+	long now;
 	XEvent ev;
-	int cfd, max_fd, sfd, xfd = ConnectionNumber(dis);
+	conn* c, * next;
+	struct epoll_event evs[MAXEVENTS];
 	struct sockaddr saddress = {AF_UNIX, INPUTSOCK};
+#ifdef SHMRING
+	char wake[64];
+#endif
 
-	if ( (sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+	if ( (sconn.fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0 )
 		die("couldn't create socket!");
 
 	unlink(INPUTSOCK);
 
-	if (bind(sfd, &saddress, sizeof(saddress)) < 0)
+	if (bind(sconn.fd, &saddress, sizeof(saddress)) < 0)
 		die("couldn't bind socket!");
 
-	if (listen(sfd, SOMAXCONN) < 0)
+	if (listen(sconn.fd, SOMAXCONN) < 0)
 		die("couldn't listen to socket!");
 
+	if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+		die("couldn't create epoll instance!");
+
+	xconn.fd = ConnectionNumber(dis);
+	watchconn(&sconn, EPOLL_CTL_ADD);
+	watchconn(&xconn, EPOLL_CTL_ADD);
+
+#ifdef SHMRING
+	/* the ring is optional, carry on with just the socket if need be */
+	unlink(INPUTWAKE);
+	if ( (cmdring = ringmap(1)) && mkfifo(INPUTWAKE, 0600) == 0
+	&& (rconn.fd = open(INPUTWAKE, O_RDWR|O_NONBLOCK|O_CLOEXEC)) >= 0 )
+		watchconn(&rconn, EPOLL_CTL_ADD);
+	else
+		fprintf(stderr, "sara: couldn't set up the command ring\n");
+#endif
+
 	runconfig();
+	tlisten = usecs(CLOCK_MONOTONIC);
 
 	while (running){
+		/* settle up once per trip, short of any open batch */
+		flushdirty();
 		XFlush(dis);
 
-		FD_ZERO(&desc);
-		FD_SET(sfd, &desc);
-		FD_SET(xfd, &desc);
-		max_fd = MAX(sfd, xfd);
-
-		if (select(max_fd + 1, &desc, NULL, NULL, NULL) > 0){
-			/* Check for socket connections */
-			if (FD_ISSET(sfd, &desc)){
-				cfd = accept(sfd, NULL, NULL);
-				if (cfd > 0 && (nbytes = recv(cfd, msg, sizeof(msg)-1, 0)) > 0){
-					msg[nbytes] = '\0';
-					handlemsg(msg);
-					close(cfd);
-				}
+		if (tstart){
+			fprintf(stderr, "sara: startup: premain %ldus, open %ldus, setup %ldus, "
+				"adopt %ldus, listen %ldus, first arrange %ldus\n", tpremain,
+				topen - tstart, tsetup - topen, tadopt - tsetup, tlisten - tadopt,
+				usecs(CLOCK_MONOTONIC) - tlisten);
+			tstart = 0;
+		}
+
+		for (pending=0, c=chead;c && !pending;c=c->next)
+			pending = c->pending;
+
+#ifdef SHMRING
+		/* tell writers to wake us, then make sure nothing slipped in first */
+		if (cmdring){
+			__atomic_store_n(&cmdring->asleep, 1, __ATOMIC_SEQ_CST);
+			pending |= __atomic_load_n(&cmdring->slots[cmdring->tail
+					& (RINGSLOTS - 1)].ready, __ATOMIC_SEQ_CST);
+		}
+#endif
+
+		/* Xlib may already hold events it read while waiting on a reply */
+		now = usecs(CLOCK_MONOTONIC) / 1000;
+		timeout = (pending || QLength(dis)) ? 0 : -1;
+		if (hoverwin && timeout)
+			timeout = MAX(hoverdue - now, 0);
+		/* and no open batch may keep the others waiting past batchdue */
+		for (c=chead;c && timeout;c=c->next)
+			if (c->inbatch && (timeout < 0 || c->batchdue - now < timeout))
+				timeout = MAX(c->batchdue - now, 0);
+		n = epoll_wait(epfd, evs, MAXEVENTS, timeout);
+
+#ifdef SHMRING
+		/* awake, so writers can leave the fifo alone until next time */
+		if (cmdring)
+			__atomic_store_n(&cmdring->asleep, 0, __ATOMIC_SEQ_CST);
+#endif
+
+		/* X always goes first */
+		while (XPending(dis)){
+			XNextEvent(dis, &ev);
+			if (events[ev.type])
+				events[ev.type](&ev);
+		}
+
+		now = usecs(CLOCK_MONOTONIC) / 1000;
+		if (hoverwin && now >= hoverdue)
+			settlehover();
+
+		/* commit for whoever began a batch and then stalled */
+		for (c=chead;c;c=c->next)
+			if (c->inbatch && now >= c->batchdue)
+				commitbatch(c, NULL);
+
+		/* then whatever was left over from last time */
+		for (c=chead;c;c=c->next)
+			if (c->pending && !c->dead)
+				handleconn(c);
+
+#ifdef SHMRING
+		if (cmdring)
+			drainring();
+#endif
+
+		for (i=0;i < n;i++){
+			if ( (c = evs[i].data.ptr) == &xconn )
+				continue;
+
+#ifdef SHMRING
+			if (c == &rconn){
+				while (read(rconn.fd, wake, sizeof(wake)) > 0);
+				continue;
 			}
+#endif
 
-			/* Check for an X event manually - XNextEvent blocks until an event occurs */
-			if (FD_ISSET(xfd, &desc)){
-				while (XCheckMaskEvent(dis, ~0, &ev))
-					if (events[ev.type])
-						events[ev.type](&ev);
+			if (c == &sconn){
+				acceptconn(sconn.fd);
+				continue;
 			}
+
+			if (evs[i].events & EPOLLOUT)
+				flushconn(c);
+
+			if ((evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && !c->rdclosed){
+				if (!c->pending && !c->dead)
+					readconn(c);
+			} else if (evs[i].events & (EPOLLHUP|EPOLLERR)){
+				c->dead = 1;
+			}
+		}
+
+		for (c=chead;c;c=next){
+			next = c->next;
+			if (c->dead)
+				closeconn(c);
 		}
 	}
 
-	close(sfd);
+	while (chead)
+		closeconn(chead);
+
+	close(epfd);
+	close(sconn.fd);
 	unlink(INPUTSOCK);
+
+#ifdef SHMRING
+	if (cmdring){
+		close(rconn.fd);
+		unlink(INPUTWAKE);
+		munmap(cmdring, sizeof(ring));
+		shm_unlink(INPUTRING);
+	}
+#endif
 }
 
+/* publish m only if its state string changed, and say so */
+int
+updatestats(monitor* m){
+	char monstate[NUMTAGS+3];
+	int i;
+
+	/* output:
+	 * "SONNNNNNN:Y"
+	 * SEL/OCC/EMPTY, left to right:curlayout->symbol
+	 */
+	for (i=0;i < NUMTAGS;i++)
+		monstate[i] = (m->seldesks & 1 << i) ? 'S'
+			: (m->occ & 1 << i) ? 'O' : 'N';
+	monstate[NUMTAGS] = ':';
+	monstate[NUMTAGS+1] = m->curlayout->letter;
+	monstate[NUMTAGS+2] = '\0';
+
+	if (STREQ(monstate, m->state))
+		return 0;
+
+	memcpy(m->state, monstate, NUMTAGS+3);
+	setrootstats(m, monstate);
+	pushstatus(m);
+
+	return 1;
+}
+
+/* Requests go out without waiting on the server, so their errors turn up
+ * here later, usually about a window that has since been destroyed.
+ * Those are expected; anything else is worth a line on stderr.
+ */
 int
 xerror(Display* dis, XErrorEvent* e){
+#ifdef GRABKEYS
+	int i;
+#endif
+
+	if (e->error_code == BadWindow
+	|| (e->request_code == X_SetInputFocus && e->error_code == BadMatch)
+	|| (e->request_code == X_ConfigureWindow && e->error_code == BadMatch)
+	|| (e->request_code == X_GrabButton && e->error_code == BadAccess)
+	|| (e->request_code == X_ChangeProperty && e->error_code == BadValue))
+		return 0;
+
+#ifdef GRABKEYS
+	if (e->request_code == X_GrabKey && e->error_code == BadAccess){
+		for (i=0;i < nkeygrabs && keygrabs[i].serial != e->serial;i++);
+		if (i < nkeygrabs && keygrabs[i].key >= 0)
+			fprintf(stderr, "sara: couldn't grab %s from keys[], another client has it\n",
+					XKeysymToString(keys[keygrabs[i].key].keysym));
+		return 0;
+	}
+#endif
+
+	fprintf(stderr, "sara: X error: request %d, error %d, serial %lu\n",
+			e->request_code, e->error_code, e->serial);
+
 	return 0;
 }
 
@@ -1567,7 +2663,7 @@ xsendkill(Window w){
 	Atom* protocols;
 	XEvent ev;
 	int exists = 0;
-	Atom destproto = XInternAtom(dis, "WM_DELETE_WINDOW", False);
+	Atom destproto = wmatom[WMDelete];
 
 	if (XGetWMProtocols(dis, w, &protocols, &n)){
 		while (!exists && n--)
@@ -1578,7 +2674,7 @@ xsendkill(Window w){
 	if (exists){
 		ev.type = ClientMessage;
 		ev.xclient.window = w;
-		ev.xclient.message_type = XInternAtom(dis, "WM_PROTOCOLS", True);
+		ev.xclient.message_type = wmatom[WMProtocols];
 		ev.xclient.format = 32;
 		ev.xclient.data.l[0] = destproto;
 		ev.xclient.data.l[1] = CurrentTime;
@@ -1603,75 +2699,87 @@ quit(const Arg arg){
 }
 
 #ifdef _SHAPE_H_
-// TODO: XCB
+/* the corners only depend on corner_radius, so work out the spans
+ * once: row y of the top left corner starts at the first pixel whose
+ * center is inside the circle, and runs of equal rows share a band
+ */
+void
+initcorners(){
+	int x, y, r = corner_radius;
+
+	if (r <= 0)
+		return;
+
+	cornerbands = ecalloc(r, sizeof(XRectangle));
+	cornerrects = ecalloc(2*r + 1, sizeof(XRectangle));
+
+	for (y=0;y < r;y++){
+		for (x=0;x < r;x++)
+			if ((2*r - 2*x - 1)*(2*r - 2*x - 1) + (2*r - 2*y - 1)*(2*r - 2*y - 1) <= 4*r*r)
+				break;
+
+		if (ncornerbands && cornerbands[ncornerbands - 1].x == x){
+			cornerbands[ncornerbands - 1].height++;
+		} else {
+			cornerbands[ncornerbands].x = x;
+			cornerbands[ncornerbands].y = y;
+			cornerbands[ncornerbands++].height = 1;
+		}
+	}
+}
+
 void
 roundcorners(client *c)
 {
-	int diam;
-	Pixmap mask;
-	GC shapegc;
+	int i, n = 0;
+	XRectangle* b;
 
-	if (corner_radius < 0)
+	if (corner_radius <= 0 || !cornerbands)
 		return;
 
 	if (!c || c->isfull)
 		return;
 
-	diam = 2 * corner_radius;
-	if (c->w < diam || c->h < diam)
+	if (c->w < 2*corner_radius || c->h < 2*corner_radius)
 		return;
 
-	if (!(mask = XCreatePixmap(dis, c->win, c->w, c->h, 1)))
+	/* already rounded at this size */
+	if (COLD(c)->shapew == c->w && COLD(c)->shapeh == c->h)
 		return;
-	
-	if (!(shapegc = XCreateGC(dis, mask, 0, NULL))){
-	    XFreePixmap(dis, mask);
-	    free(shapegc);
-	    return;
-	}
 
-	XFillRectangle(dis, mask, shapegc, 0, 0, c->w, c->h);
-	XSetForeground(dis, shapegc, 1);
-
-	/* topleft, topright, bottomleft, bottomright
-	 * man XArc - positive is counterclockwise
+	/* top bands, the middle, then the bottom bands mirrored,
+	 * which keeps them sorted for YXBanded
 	 */
-	XFillArc(dis, mask, shapegc, 0, 		0, 			diam, diam, 90 * 64, 90 * 64);
-	XFillArc(dis, mask, shapegc, c->w - diam - 1, 	0, 			diam, diam, 0 * 64, 90 * 64);
-	XFillArc(dis, mask, shapegc, 0,			c->h - diam - 1,	diam, diam, -90 * 64, -90 * 64);
-	XFillArc(dis, mask, shapegc, c->w - diam - 1,	c->h - diam - 1,	diam, diam, 0 * 64, -90 * 64);
+	for (i=0;i < ncornerbands;i++){
+		b = &cornerbands[i];
+		cornerrects[n++] = (XRectangle) {b->x, b->y, c->w - 2*b->x, b->height};
+	}
+	cornerrects[n++] = (XRectangle) {0, corner_radius, c->w, c->h - 2*corner_radius};
+	for (i=ncornerbands - 1;i >= 0;i--){
+		b = &cornerbands[i];
+		cornerrects[n++] = (XRectangle) {b->x, c->h - b->y - b->height, c->w - 2*b->x, b->height};
+	}
 
-	XFillRectangle(dis, mask, shapegc, corner_radius, 0, c->w - diam, c->h);
-	XFillRectangle(dis, mask, shapegc, 0, corner_radius, c->w, c->h - diam);
-	XShapeCombineMask(dis, c->win, ShapeBounding, 0, 0, mask, ShapeSet);
-	XFreePixmap(dis, mask);
-	XFreeGC(dis, shapegc);
+	XShapeCombineRectangles(dis, c->win, ShapeBounding, 0, 0,
+		cornerrects, n, ShapeSet, YXBanded);
+
+	COLD(c)->shapew = c->w;
+	COLD(c)->shapeh = c->h;
 }
 
-// TODO: XCB
 void
 unroundcorners(client *c)
 {
-	Pixmap mask;
-	GC shapegc;
+	XRectangle r;
 
-	if (corner_radius < 0 || !c)
+	if (corner_radius <= 0 || !c)
 		return;
 
-	if (!(mask = XCreatePixmap(dis, c->win, c->w, c->h, 1)))
-		return;
-	
-	if (!(shapegc = XCreateGC(dis, mask, 0, NULL))){
-	    XFreePixmap(dis, mask);
-	    free(shapegc);
-	    return;
-	}
+	r = (XRectangle) {0, 0, c->w, c->h};
+	XShapeCombineRectangles(dis, c->win, ShapeBounding, 0, 0,
+		&r, 1, ShapeSet, YXBanded);
 
-	XSetForeground(dis, shapegc, 1);
-	XFillRectangle(dis, mask, shapegc, 0, 0, c->w, c->h);
-	XShapeCombineMask(dis, c->win, ShapeBounding, 0, 0, mask, ShapeSet);
-	XFreePixmap(dis, mask);
-	XFreeGC(dis, shapegc);
+	COLD(c)->shapew = COLD(c)->shapeh = 0;
 }
 #endif
 
@@ -1681,22 +2789,476 @@ unroundcorners(client *c)
  * ---------------------------------------
  */
 
+void
+acceptconn(int sfd){
+	int i, cfd;
+	conn* c;
+
+	for (i=0;i < MAXEVENTS && (cfd = accept(sfd, NULL, NULL)) >= 0;i++){
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+		fcntl(cfd, F_SETFD, FD_CLOEXEC);
+
+		c = ecalloc(1, sizeof(conn));
+		c->fd = cfd;
+		c->next = chead;
+		chead = c;
+		watchconn(c, EPOLL_CTL_ADD);
+	}
+}
+
+/* hold off arranging for everything up to "commit", or for batchms */
+void
+beginbatch(conn* c, char* arg){
+	if (!c->inbatch)
+		c->batchdue = usecs(CLOCK_MONOTONIC) / 1000 + batchms;
+	c->inbatch = 1;
+}
+
+void
+closeconn(conn* c){
+	conn** t;
+
+	/* out of the list, so a batch left hanging is committed */
+	for (t=&chead;*t && *t != c;t=&(*t)->next);
+	*t = c->next;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out.s);
+	free(c->subfmt);
+	free(c);
+}
+
+void
+commitbatch(conn* c, char* arg){
+	c->inbatch = 0;
+	c->held = 0;
+}
+
+#ifdef SHMRING
+/* Run up to IPCBUDGET messages from the ring. Nothing can answer them,
+ * so queries and subscriptions are ignored.
+ */
+void
+drainring(){
+	int n;
+	char msg[MAXBUFF];
+	ringslot* slot;
+
+	for (n=0;n < IPCBUDGET;n++){
+		slot = &cmdring->slots[cmdring->tail & (RINGSLOTS - 1)];
+		if (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			break;
+
+		/* free the slot before running anything */
+		memcpy(msg, slot->msg, MAXBUFF);
+		msg[MAXBUFF-1] = '\0';
+		__atomic_store_n(&slot->ready, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cmdring->tail, cmdring->tail + 1, __ATOMIC_RELEASE);
+
+		handlemsg(NULL, msg);
+	}
+}
+#endif
+
+void
+dumpclients(buffer* b){
+	bufprintf(b, "[");
+	for EACHMON(mhead){
+		for EACHCLIENT(im->head){
+			bufprintf(b, "%s{\"win\":%lu,\"mon\":%d,\"x\":%d,\"y\":%d,"
+				"\"w\":%d,\"h\":%d,\"desks\":%u,\"iscur\":%u,"
+				"\"isfloat\":%d,\"isfull\":%d,\"current\":%s}",
+				(b->s[b->len-1] == '[') ? "" : ",",
+				ic->win, im->num, ic->x, ic->y, ic->w, ic->h, ic->desks,
+				ic->iscur, ic->isfloat, ic->isfull,
+				(ic == im->current) ? "true" : "false");
+		}
+	}
+	bufprintf(b, "]");
+}
+
+void
+dumpmonitors(buffer* b){
+	int i;
+
+	bufprintf(b, "[");
+	for EACHMON(mhead){
+		bufprintf(b, "%s{\"num\":%d,\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,"
+			"\"wy\":%d,\"wh\":%d,\"seldesks\":%u,\"curdesk\":%d,"
+			"\"focused\":%s,\"current\":%lu,\"desks\":[",
+			(im == mhead) ? "" : ",",
+			im->num, im->mx, im->my, im->mw, im->mh, im->wy, im->wh,
+			im->seldesks, im->curdesk, (im == curmon) ? "true" : "false",
+			im->current ? im->current->win : None);
+
+		/* the selected desktop's settings live in the monitor until loaddesktop */
+		for (i=0;i < NUMTAGS;i++)
+			bufprintf(b, "%s{\"layout\":\"%s\",\"msize\":%g}",
+				i ? "," : "",
+				(i == im->curdesk) ? im->curlayout->name : im->desks[i].curlayout->name,
+				(i == im->curdesk) ? im->msize : im->desks[i].msize);
+		bufprintf(b, "]}");
+	}
+	bufprintf(b, "]");
+}
+
+void
+dumppools(buffer* b){
+	int i;
+	pool* p;
+
+	bufprintf(b, "{");
+	for (i=0;i < TABLENGTH(pools);i++){
+		p = pools[i];
+		bufprintf(b, "%s\"%s\":{\"size\":%zu,\"slabs\":%d,\"capacity\":%d,"
+			"\"inuse\":%lu,\"gets\":%lu,\"puts\":%lu}",
+			i ? "," : "", p->name, p->size, p->nslabs, p->nslabs * p->perslab,
+			p->gets - p->puts, p->gets, p->puts);
+	}
+	bufprintf(b, "}");
+}
+
+void
+dumpstate(buffer* b){
+	bufprintf(b, "{\"monitors\":");
+	dumpmonitors(b);
+	bufprintf(b, ",\"clients\":");
+	dumpclients(b);
+	bufprintf(b, "}");
+}
+
+void
+flushconn(conn* c){
+	ssize_t n;
+
+	if ( (n = send(c->fd, c->out.s, c->out.len, MSG_NOSIGNAL|MSG_DONTWAIT)) < 0 ){
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			c->dead = 1;
+		return;
+	}
+
+	c->out.len -= n;
+	memmove(c->out.s, c->out.s + n, c->out.len);
+
+	if (!c->out.len){
+		/* a one-shot sarasock has everything it asked for */
+		if (c->rdclosed && !c->subscribed)
+			c->dead = 1;
+		else
+			watchconn(c, EPOLL_CTL_MOD);
+	}
+}
+
+/* Expand a subscribe template for m, see sara(1).
+ * tag is the tag being expanded inside a %[ %] block, else -1.
+ */
+void
+fmtstatus(buffer* b, const char* fmt, size_t len, monitor* m, int tag){
+	int i, alt;
+	const char* end = fmt + len, * p, * q;
+
+	for (;fmt < end;fmt++){
+		if (*fmt != '%' || fmt + 1 == end){
+			bufprintf(b, "%c", *fmt);
+			continue;
+		}
+
+		switch (*++fmt){
+		case 'm':
+			bufprintf(b, "%d", m->num);
+			break;
+		case 'l':
+			bufprintf(b, "%c", m->curlayout->letter);
+			break;
+		case 'L':
+			bufprintf(b, "%s", m->curlayout->name);
+			break;
+		case 't':
+			bufprintf(b, "%.*s", NUMTAGS, m->state);
+			break;
+		case 'f':
+			bufprintf(b, "%lu", m->current ? m->current->win : None);
+			break;
+		case 'i':
+			if (tag >= 0)
+				bufprintf(b, "%d", tag);
+			break;
+		case 's':
+			if (tag >= 0)
+				bufprintf(b, "%c", m->state[tag]);
+			break;
+		case '[':
+			/* repeat up to the matching %] for each tag */
+			for (p=++fmt;p + 1 < end && !(p[0] == '%' && p[1] == ']');p++);
+			for (i=0;i < NUMTAGS;i++)
+				fmtstatus(b, fmt, p - fmt, m, i);
+			fmt = (p + 1 < end) ? p + 1 : end;
+			break;
+		case '(':
+			/* %(selected%|occupied%|empty%) */
+			alt = (tag < 0) ? 0 : (m->state[tag] == 'S') ? 0 : (m->state[tag] == 'O') ? 1 : 2;
+			for (i=0, p=q=++fmt;q + 1 < end && !(q[0] == '%' && q[1] == ')');q++){
+				if (q[0] == '%' && q[1] == '|'){
+					if (i++ == alt)
+						break;
+					p = q + 2;
+				}
+			}
+			if (i >= alt)
+				fmtstatus(b, p, q - p, m, tag);
+			for (;q + 1 < end && !(q[0] == '%' && q[1] == ')');q++);
+			fmt = (q + 1 < end) ? q + 1 : end;
+			break;
+		case '%':
+			bufprintf(b, "%%");
+			break;
+		default:
+			/* not ours, like lemonbar's %{F...}, so pass it on whole */
+			bufprintf(b, "%%%c", *fmt);
+			break;
+		}
+	}
+}
+
+/* Handle at most IPCBUDGET of c's buffered messages, so one busy connection
+ * can't hold up X or anyone else. The rest wait for the next trip around.
+ * Messages are framed by '\n' or '\0', so one connection can carry any
+ * number of them. A message that won't fit in MAXBUFF is dropped whole.
+ */
+void
+handleconn(conn* c){
+	int budget = IPCBUDGET;
+	char* msg, * end;
+
+	c->pending = 0;
+
+	for (msg=end=c->buf;end < c->buf + c->len && !c->dead;end++){
+		if (*end != '\n' && *end != '\0')
+			continue;
+
+		if (budget-- == 0){
+			c->pending = 1;
+			break;
+		}
+
+		*end = '\0';
+		if (!c->skip && *msg)
+			handlemsg(c, msg);
+		c->skip = 0;
+		msg = end + 1;
+	}
+
+	c->len -= msg - c->buf;
+	memmove(c->buf, msg, c->len);
+
+	if (c->len == sizeof(c->buf)){
+		c->skip = 1;
+		c->len = 0;
+	}
+}
+
 /* Thanks to bspwm's handle_message and process_message for some inspiration */
 void
-handlemsg(char* msg){
+handlemsg(conn* c, char* msg){
 	char* funcstr, * argstr;
 	void (*func)(Arg);
+	void (*connfunc)(conn*, char*);
+	void (*query)(buffer*);
 	Arg arg;
+	buffer b = {NULL, 0, 0};
 
-	funcstr = strtok(msg, " ");
-	argstr = strtok(NULL, " ");
+	if ( !(funcstr = strtok(msg, " ")) )
+		return;
+	argstr = strtok(NULL, "");
+
+	/* nobody to answer to from the ring */
+	if ( (connfunc = str2connfunc(funcstr)) ){
+		if (c)
+			connfunc(c, argstr);
 
-	if (argstr){
+	} else if ( (query = str2query(funcstr)) ){
+		if (!c)
+			return;
+		/* answer with geometry as it will be, not as it was */
+		flushdirty();
+		query(&b);
+		bufprintf(&b, "\n");
+		sendconn(c, b.s, b.len);
+		free(b.s);
+
+	} else if ( (argstr = argstr ? strtok(argstr, " ") : NULL) ){
 		arg.s = argstr;
 
-		if ( (func = str2func(funcstr)) )
+		if ( (func = str2func(funcstr)) ){
+			batching = (c && c->inbatch) ? c : NULL;
 			func(arg);
+			batching = NULL;
+		}
+	}
+}
+
+/* queued on m, to go out in order once no batch holds it back */
+void
+pushevent(monitor* m, const char* fmt, ...){
+	int n;
+	char line[MAXBUFF];
+	conn* c;
+	va_list ap;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+	n = (n > sizeof(line) - 2) ? sizeof(line) - 2 : n;
+	line[n++] = '\n';
+
+	for (c=chead;c && !c->subscribed;c=c->next);
+	if (!c)
+		return;
+
+	/* the batch running now holds m back too, once it's touched */
+	if (batching)
+		batching->held |= MONBIT(m);
+
+	bufprintf(&m->events, "%.*s", n, line);
+	if (!isheld(m))
+		sendevents(m);
+}
+
+void
+pushstatus(monitor* m){
+	conn* c;
+
+	for (c=chead;c;c=c->next)
+		if (c->subscribed)
+			sendstatus(c, m);
+}
+
+/* Messages are framed by '\n' or '\0', so one connection can carry any
+ * number of them. A message that won't fit in MAXBUFF is dropped whole.
+ */
+void
+readconn(conn* c){
+	ssize_t nbytes;
+
+	if ( (nbytes = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0)) < 0 ){
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			c->dead = 1;
+		return;
+	}
+
+	/* keep feeding subscribers that have hung up their end,
+	 * and everyone else until their replies are out
+	 */
+	if (nbytes == 0){
+		c->rdclosed = 1;
+		if (!c->subscribed && !c->out.len)
+			c->dead = 1;
+		else
+			watchconn(c, EPOLL_CTL_MOD);
+		return;
+	}
+
+	c->len += nbytes;
+	handleconn(c);
+}
+
+/* Never block on a slow reader: what it can't take yet waits in c->out,
+ * and anyone who falls MAXOUTBUF behind is dropped
+ */
+void
+sendconn(conn* c, const char* s, size_t len){
+	ssize_t n = 0;
+	int wasempty = !c->out.len;
+
+	if (c->dead)
+		return;
+
+	if (wasempty && (n = send(c->fd, s, len, MSG_NOSIGNAL|MSG_DONTWAIT)) < 0){
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+			c->dead = 1;
+			return;
+		}
+		n = 0;
+	}
+
+	if (n == len)
+		return;
+
+	if (c->out.len + (len - n) > MAXOUTBUF){
+		c->dead = 1;
+		return;
 	}
+
+	bufprintf(&c->out, "%.*s", (int) (len - n), s + n);
+	if (wasempty)
+		watchconn(c, EPOLL_CTL_MOD);
+}
+
+void
+sendevents(monitor* m){
+	conn* c;
+
+	/* templates are for status lines only */
+	for (c=chead;c;c=c->next)
+		if (c->subscribed && !c->subfmt && (c->submon < 0 || c->submon == m->num))
+			sendconn(c, m->events.s, m->events.len);
+
+	m->events.len = 0;
+}
+
+void
+sendstatus(conn* c, monitor* m){
+	if (c->submon >= 0 && c->submon != m->num)
+		return;
+
+	statusbuf.len = 0;
+	if (c->subfmt)
+		fmtstatus(&statusbuf, c->subfmt, slen(c->subfmt), m, -1);
+	else
+		bufprintf(&statusbuf, "status %d %s", m->num, m->state);
+	bufprintf(&statusbuf, "\n");
+
+	sendconn(c, statusbuf.s, statusbuf.len);
+}
+
+/* "subscribe [-m num] [template]" */
+void
+subscribe(conn* c, char* arg){
+	char* end, line[MAXBUFF];
+
+	c->subscribed = 1;
+	c->submon = -1;
+
+	if (arg && strncmp(arg, "-m ", 3) == 0){
+		c->submon = (int) strtol(arg + 3, &end, 10);
+		arg = (*end == ' ') ? end + 1 : end;
+	}
+
+	free(c->subfmt);
+	c->subfmt = (arg && *arg) ? strdup(arg) : NULL;
+
+	/* start the subscriber off with where things stand */
+	for EACHMON(mhead)
+		sendstatus(c, im);
+
+	if (!c->subfmt && curmon && (c->submon < 0 || c->submon == curmon->num)){
+		snprintf(line, sizeof(line), "focus %d %lu\n", curmon->num,
+				curmon->current ? curmon->current->win : None);
+		sendconn(c, line, slen(line));
+	}
+}
+
+void (*str2connfunc(const char* str))(conn*, char*){
+	int i;
+	for (i=0;i < TABLENGTH(connfuncs);i++)
+		if (STREQ(str, connfuncs[i].str))
+			return connfuncs[i].func;
+
+	return NULL;
 }
 
 /* thanks to StackOverflow's wallyk for analagous str2enum */
@@ -1709,6 +3271,25 @@ void (*str2func(const char* str))(Arg){
 	return NULL;
 }
 
+void (*str2query(const char* str))(buffer*){
+	int i;
+	for (i=0;i < TABLENGTH(queries);i++)
+		if (STREQ(str, queries[i].str))
+			return queries[i].func;
+
+	return NULL;
+}
+
+/* (re)register c with epoll for whatever it is waiting on */
+void
+watchconn(conn* c, int op){
+	struct epoll_event ev;
+
+	ev.data.ptr = c;
+	ev.events = (c->rdclosed ? 0 : EPOLLIN) | (c->out.len ? EPOLLOUT : 0);
+	epoll_ctl(epfd, op, c->fd, &ev);
+}
+
 
 /* ---------------------------------------
  * X
@@ -1716,34 +3297,55 @@ void (*str2func(const char* str))(Arg){
  */
 
 
-// TODO: XCB
 /* dwm */
 void
 adopt(){
 	unsigned int i, num;
 	Window d1, d2, * wins = NULL;
-	XWindowAttributes wa;
+	winprops* p;
+	client* c;
+	monitor* m;
 
-	if (XQueryTree(dis, root, &d1, &d2, &wins, &num)) {
-		for (i = 0; i < num; i++) {
-			if (!XGetWindowAttributes(dis, wins[i], &wa)
-			|| wa.override_redirect || XGetTransientForHint(dis, wins[i], &d1))
-				continue;
-			if (wa.map_state == IsViewable)
-				manage(wins[i], &wa);
-		}
+	if (!XQueryTree(dis, root, &d1, &d2, &wins, &num))
+		return;
 
-		for (i = 0; i < num; i++) { /* now the transients */
-			if (!XGetWindowAttributes(dis, wins[i], &wa))
-				continue;
-			if (XGetTransientForHint(dis, wins[i], &d1)
-			&& (wa.map_state == IsViewable))
-				manage(wins[i], &wa);
+	p = ecalloc(num, sizeof(winprops));
+	for (i=0;i < num;i++)
+		p[i].win = wins[i];
+	fetchprops(p, num);
+
+	for (i=0;i < num;i++)
+		if (p[i].ok && !p[i].override_redirect && p[i].trans == None && p[i].viewable)
+			manage(&p[i], NoFocus);
+
+	/* now the transients */
+	for (i=0;i < num;i++)
+		if (p[i].ok && !p[i].override_redirect && p[i].trans != None && p[i].viewable)
+			manage(&p[i], NoFocus);
+
+	/* as if each had been focused as it came in: the last one on
+	 * each monitor is current, and only it may be fullscreen
+	 */
+	for (m=mhead;m;m=m->next){
+		for EACHCLIENT(m->head)
+			if (ic->isfull && (ic != m->current || m != curmon))
+				ic->isfull = 0;
+
+		if ( (c = m->current) ){
+			m->current = NULL;
+			changecurrent(c, m, m->curdesk, 0);
 		}
+	}
 
-		if (wins)
-			XFree(wins);
+	if (curmon->current && curmon->current->isfull){
+		curmon->current->isfull = 0;
+		togglefs(dumbarg);
 	}
+	updatefocus(curmon);
+
+	free(p);
+	if (wins)
+		XFree(wins);
 }
 
 void
@@ -1813,8 +3415,12 @@ configurerequest(XEvent* e){
 				c->y = m->wy + (m->wh / 2 - c->h / 2);
 			if ((ev->value_mask & (CWX|CWY)) && !(ev->value_mask & (CWWidth|CWHeight)))
 				configure(c);
-			if (ISVISIBLE(c))
-				XMoveResizeWindow(dis, c->win, c->x, c->y, c->w, c->h);
+			if (ISVISIBLE(c)){
+				applygeom(c, c->x, c->y, c->w, c->h);
+#ifdef _SHAPE_H_
+				roundcorners(c);
+#endif
+			}
 
 		} else {
 			configure(c);
@@ -1829,8 +3435,6 @@ configurerequest(XEvent* e){
 		wc.stack_mode = ev->detail;
 		XConfigureWindow(dis, ev->window, ev->value_mask, &wc);
 	}
-
-	XSync(dis, False);
 }
 
 void
@@ -1851,9 +3455,20 @@ enternotify(XEvent* e){
 	if ((ev->mode != NotifyNormal || ev->detail == NotifyInferior) && ev->window != root)
 		return;
 
+	if ((long) (ev->serial - enterserial) < 0)
+		return;
+
+	/* only the window the pointer settles on, see settlehover */
+	hoverwin = None;
 	if ( !(c = findclient(ev->window)) || c == curmon->current )
 		return;
 
+	if (hoverms){
+		hoverwin = c->win;
+		hoverdue = usecs(CLOCK_MONOTONIC) / 1000 + hoverms;
+		return;
+	}
+
 	if ( (m = c->mon) && m != curmon )
 		changemon(m, YesFocus);
 
@@ -1868,16 +3483,42 @@ focusin(XEvent* e){
 		updatefocus(curmon);
 }
 
+#ifdef GRABKEYS
+/* same functions sarasock reaches through conversions, minus the socket */
+void
+keypress(XEvent* e){
+	int i;
+	KeySym keysym;
+	XKeyEvent* ev = &e->xkey;
+
+	keysym = XKeycodeToKeysym(dis, (KeyCode) ev->keycode, 0);
+	for (i=0;i < TABLENGTH(keys);i++)
+		if (keysym == keys[i].keysym && keys[i].func
+		&& CLEANMASK(keys[i].mod) == CLEANMASK(ev->state))
+			keys[i].func(keys[i].arg);
+}
+
+void
+mappingnotify(XEvent* e){
+	XMappingEvent* ev = &e->xmapping;
+
+	XRefreshKeyboardMapping(ev);
+	if (ev->request == MappingKeyboard)
+		grabkeys();
+}
+#endif
+
 void
 maprequest(XEvent* e){
-	XWindowAttributes wa;
 	XMapRequestEvent* ev = &e->xmaprequest;
+	winprops p = { .win = ev->window };
 
-	if (!XGetWindowAttributes(dis, ev->window, &wa) || wa.override_redirect)
+	if (findclient(ev->window))
 		return;
 
-	if (!findclient(ev->window))
-		manage(ev->window, &wa);
+	fetchprops(&p, 1);
+	if (p.ok && !p.override_redirect)
+		manage(&p, YesFocus);
 }
 
 void
@@ -1904,12 +3545,19 @@ unmapnotify(XEvent* e){
 
 int
 main(){
+	/* cpu spent before main is mostly the loader binding shared libraries */
+	tpremain = usecs(CLOCK_PROCESS_CPUTIME_ID);
+	tstart = usecs(CLOCK_MONOTONIC);
+
 	if ( !(dis = XOpenDisplay(NULL)) )
 		die("Cannot open display!");
 	XSetErrorHandler(xerror);
+	topen = usecs(CLOCK_MONOTONIC);
 	setup();
+	tsetup = usecs(CLOCK_MONOTONIC);
 
 	adopt();
+	tadopt = usecs(CLOCK_MONOTONIC);
 	start();
 
 	if (restart)
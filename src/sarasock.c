@@ -13,37 +13,116 @@
 #include <poll.h>
 #include <sys/un.h>
 #include <unistd.h>
+#ifdef SHMRING
+#include <fcntl.h>
+#endif
 
 #include "common.h"
 
 
+static int joinargs(int argc, char* argv[], char* msg);
+static void sendall(int sfd, const char* buf, size_t len);
+
+
+/* join argv with spaces into msg, leaving room for a '\n'
+ * sara would drop a longer message, so don't send half of one
+ */
+int
+joinargs(int argc, char* argv[], char* msg){
+	int i, len = 0;
+
+	msg[0] = '\0';
+	for (i=0;i < argc;i++){
+		len += snprintf(msg + len, MAXBUFF - 1 - len, "%s%s",
+				(i != 0) ? " " : "", argv[i]);
+		if (len > MAXBUFF - 2)
+			die("message too long, see MAXBUFF!");
+	}
+
+	return len;
+}
+
+void
+sendall(int sfd, const char* buf, size_t len){
+	ssize_t n;
+
+	while (len > 0){
+		if ( (n = send(sfd, buf, len, 0)) < 0 )
+			die("failed to send to socket!");
+		buf += n;
+		len -= n;
+	}
+}
+
 int
 main(int argc, char* argv[]){
-	int i, sfd, left = MAXBUFF;
+	int sfd, nfds = 1, len = 0;
+	ssize_t n;
 	char msg[MAXBUFF];
 	struct sockaddr saddress = {AF_UNIX, INPUTSOCK};
+	struct pollfd fds[2];
+#ifdef SHMRING
+	ring* r;
+#endif
 
 	if (argc < 2)
 		die("please provide at least one argument!");
 
-	for (i=1;i < argc && left > 0;i++){
-		if (i != 1){
-			strncat(msg, " ", 2);
-			left--;
-		}
-
-		strncat(msg, argv[i], slen(argv[i]) > left ? left : slen(argv[i]) );
-		left -= slen(argv[i]);
+#ifdef SHMRING
+	/* "sarasock -r command": drop it in the shared memory ring,
+	 * falling back to the socket if the ring isn't there or is full
+	 */
+	if (argc > 2 && strcmp(argv[1], "-r") == 0){
+		argc--;
+		argv++;
+		joinargs(argc - 1, argv + 1, msg);
+		if ( (r = ringmap(0)) && ringsend(r, open(INPUTWAKE, O_WRONLY|O_NONBLOCK), msg) == 0 )
+			return 0;
 	}
+#endif
 
-	msg[MAXBUFF-1] = '\0';
+	/* "sarasock -": stream newline-delimited commands from stdin
+	 * over one connection
+	 */
+	if (argc == 2 && strcmp(argv[1], "-") == 0)
+		nfds = 2;
+	else
+		len = joinargs(argc - 1, argv + 1, msg);
 
 	if ( (sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
 		die("failed to create socket!");
 	if (connect(sfd, &saddress, sizeof(saddress)) < 0)
 		die("failed to connect to socket!");
-	if (send(sfd, msg, MAXBUFF, 0) < 0)
-		die("failed to send to socket!");
+
+	if (nfds == 1){
+		msg[len++] = '\n';
+		sendall(sfd, msg, len);
+		shutdown(sfd, SHUT_WR);
+	}
+
+	/* print any replies until sara hangs up, which it does once we're done */
+	fds[0].fd = sfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = STDIN_FILENO;
+	fds[1].events = POLLIN;
+
+	while (poll(fds, nfds, -1) > 0){
+		if (nfds > 1 && fds[1].revents){
+			if ( (n = read(STDIN_FILENO, msg, sizeof(msg))) > 0 ){
+				sendall(sfd, msg, n);
+			} else {
+				shutdown(sfd, SHUT_WR);
+				nfds = 1;
+			}
+		}
+
+		if (fds[0].revents){
+			if ( (n = recv(sfd, msg, sizeof(msg), 0)) <= 0 )
+				break;
+			if (write(STDOUT_FILENO, msg, n) < 0)
+				break;
+		}
+	}
 
 	close(sfd);
 